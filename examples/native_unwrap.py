@@ -0,0 +1,25 @@
+# the same as unwrap.py, but with the native module (build with -DBUILD_PYTHON_MODULE=ON and put lens_undistort.so on the path)
+# no executables, no hdf5 round trip: the map is computed straight into a numpy array
+
+import cv2
+import numpy as np
+
+import lens_undistort
+
+calibration = cv2.FileStorage("calibration.xml", cv2.FILE_STORAGE_READ)
+factors = [ calibration.getNode(name).real() for name in ("cx", "cy", "k1", "k2") ]
+frame_size = ( int(calibration.getNode("width").real()), int(calibration.getNode("height").real()) )
+unwrap_factor = 1.0
+
+width, height = lens_undistort.unwrap_size( factors, frame_size, unwrap_factor )
+unwrap_map = np.empty( (height, width, 2), np.float32 )
+unwrap_mask = np.empty( (height, width), np.uint8 )
+lens_undistort.prepare_unwrap( factors, frame_size, unwrap_factor, unwrap_map, unwrap_mask )
+
+
+input_frame = cv2.imread("test.png")
+unwrapped = np.empty( (height, width, 3), np.uint8 )
+lens_undistort.remap( input_frame, unwrap_map, unwrapped )
+
+cv2.imshow("unwrapped", unwrapped)
+cv2.waitKey(0)
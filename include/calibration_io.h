@@ -0,0 +1,18 @@
+#ifndef CALIBRATION_IO_H
+#define CALIBRATION_IO_H
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "undistort.h"
+
+
+// the xml or yaml file lens_undistort --output_xml writes: cx, cy, k1, k2, width, height
+void write_calibration( const std::string &filename, const double undistorsion_factors[MODEL_SIZE], cv::Size frame_size );
+
+// returns false if the file can't be opened
+bool read_calibration( const std::string &filename, double undistorsion_factors[MODEL_SIZE], cv::Size &frame_size );
+
+
+#endif // CALIBRATION_IO_H
@@ -0,0 +1,60 @@
+#ifndef LANCZOS_REMAP_H
+#define LANCZOS_REMAP_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+
+/*
+	cv::remap with INTER_LANCZOS4 and a constant zero border, specialized for a map that never changes.
+	The map is turned once into a per pixel table of the 8x8 source window corner and the quantized
+	fractional position, 1/32 pixel like cv::remap. The separable Lanczos weights of the 32 positions are
+	tabulated too, so a frame is only multiply-accumulates over fixed size loops the compiler vectorizes.
+	Works on CV_8UC1 and CV_8UC3 frames of any size. execute can be called from multiple threads
+	concurrently, as long as each thread has its own dst.
+*/
+class LanczosRemapper
+{
+public:
+	// map is CV_32FC2, like the ones of UnwrapPlan
+	explicit LanczosRemapper( const cv::Mat &map );
+
+	cv::Size output_size() const { return map_size; }
+
+	static bool supports( const cv::Mat &src ) { return src.type()==CV_8UC1 || src.type()==CV_8UC3; }
+
+	// dst is (re)allocated only if its size or type doesn't match
+	void execute( const cv::Mat &src, cv::Mat &dst ) const;
+
+	// the same to a CV_8UC1 dst, a 3 channel src is converted like cv::COLOR_BGR2GRAY while sampled
+	void execute_gray( const cv::Mat &src, cv::Mat &dst ) const;
+
+	// remaps the rows of an already allocated dst on the calling thread, for callers that schedule the work
+	// themselves. dst may be a view into a bigger buffer. a CV_8UC1 dst of a 3 channel src means gray output
+	void execute_rows( const cv::Mat &src, cv::Mat &dst, cv::Range rows ) const;
+
+	// the same for only the cols of the rows, the other pixels of dst are left as they are
+	void execute_block( const cv::Mat &src, cv::Mat &dst, cv::Range rows, cv::Range cols ) const;
+
+	// one entry per output pixel, row by row
+	struct Tap {
+		int16_t x;  // left column of the source window
+		int16_t y;  // top row of the source window
+		uint8_t fx; // fractional position, in 1/TABLE_SIZE pixels
+		uint8_t fy;
+	};
+
+	static const int TABLE_BITS = 5;
+	static const int TABLE_SIZE = 1 << TABLE_BITS;
+	static const int TAPS = 8;
+
+private:
+	cv::Size map_size;
+	std::vector<Tap> taps;
+	float weights[TABLE_SIZE][TAPS];
+};
+
+
+#endif // LANCZOS_REMAP_H
@@ -0,0 +1,38 @@
+#ifndef LINE_CACHE_H
+#define LINE_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "lines.h"
+
+
+// extracted lines saved for later fits, with what they were extracted from
+struct LineCache {
+	cv::Size frame_size;
+	std::vector<std::string> sources; // see source_fingerprint
+	Lines lines;
+};
+
+/*
+	The file is the magic, then varints: frame width and height, the sources as length and bytes,
+	then the lines as point count, the first point, and the zigzag coded deltas of the rest.
+	Lines are contours, their consecutive points are neighbours, so a point takes about 2 bytes.
+*/
+void write_line_cache( const std::string &path, const LineCache &cache );
+
+// false if path is not a line cache. a damaged cache is an error
+bool read_line_cache( const std::string &path, LineCache &cache );
+
+// identifies an input file by its path, size and modification time
+std::string source_fingerprint( const std::string &path );
+
+// appends the lines of from to into, unless all of its sources are in into already.
+// returns false if from was skipped as a duplicate. the frame sizes should match, and
+// from shouldn't share only some of its sources with into
+bool merge_line_cache( LineCache &into, const LineCache &from );
+
+
+#endif // LINE_CACHE_H
@@ -0,0 +1,66 @@
+#ifndef LINE_TRACKER_H
+#define LINE_TRACKER_H
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "lines.h"
+
+
+struct LineTrackerOptions {
+	int keyframe_interval = 30;       // a full extract_lines at least every this many frames, zero means only when tracking fails
+	int point_step = 4;               // every this many points of a detected line are tracked, the tracked lines have only those
+	int search_radius = 6;            // how far a point's edge is searched along the line normal, in pixels
+	double min_edge_strength = 10.0;  // gray level difference over 2 pixels a point's edge needs
+	double min_found_ratio = 0.9;     // a line with fewer of its points found is lost
+	double min_tracked_ratio = 0.7;   // a full extraction runs if fewer of the lines of the last one are still tracked
+	double min_motion = 2.0;          // a line is passed on again only after it moved this much since, mean pixels
+};
+
+
+/*
+	extract_lines for consecutive frames of a video. After a full extraction the lines are followed into
+	the next frames: every tracked point looks for the edge of its line within a few pixels along the line
+	normal, which costs a fraction of the blur, threshold and contour chain. The full extraction runs again
+	on keyframes, or when too many lines are lost. A line that barely moved since it was last passed on
+	would only weigh the fit towards itself, so it is passed on again only after it moved enough, also
+	when a keyframe detects it again. Not thread safe, every video needs its own tracker, or a reset.
+*/
+class LineTracker
+{
+public:
+	explicit LineTracker( const LineTrackerOptions &options = LineTrackerOptions() );
+
+	// the lines of the next frame, a BGR image like extract_lines takes, are added to lines if they are new
+	// or moved enough. returns true if the frame was a keyframe
+	bool track( const cv::Mat &frame, Lines &lines );
+
+	// forgets the lines, the next frame is a keyframe. for a cut, or a new video
+	void reset();
+
+	int frames() const { return frame_count; }
+	int keyframes() const { return keyframe_count; }
+
+private:
+	struct Track {
+		Line line;     // where it is now
+		Line emitted;  // where it was last passed on
+		int polarity;  // 1 if the frame gets brighter to the left of the line, -1 otherwise
+	};
+
+	bool follow( const cv::Mat &gray, Track &track ) const;
+	void detect( const cv::Mat &frame, const cv::Mat &gray, Lines &lines );
+
+	LineTrackerOptions options;
+	std::vector<Track> tracks;
+	Lines lost;  // where the lines lost since the last keyframe were passed on last
+	size_t detected_count;
+	cv::Size frame_size;
+	int frames_since_keyframe;
+	int frame_count;
+	int keyframe_count;
+};
+
+
+#endif // LINE_TRACKER_H
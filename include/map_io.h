@@ -0,0 +1,82 @@
+#ifndef MAP_IO_H
+#define MAP_IO_H
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "hdf5.h"
+
+#include "valid_spans.h"
+
+
+/*
+	Writes a CV_32FC2 map or a CV_8UC1 mask as a (rows, cols, channels) dataset, like CVHDFS::write,
+	but chunked in bands of band_rows rows, so a band can be read without touching the rest.
+	deflate_level is 0 (no compression) to 9. A plain chunked dataset reads back with CVHDFS::read too.
+	With identity_delta the map is stored as map - (x, y), which is near zero and smooth, so it
+	compresses much better. Such datasets are marked with an "identity_delta" attribute, and need
+	MapBandReader or read_map to be read back.
+*/
+void write_map_bands(
+	const std::string &path,
+	const std::string &name,
+	const cv::Mat &map,
+	int band_rows,
+	int deflate_level,
+	bool identity_delta
+);
+
+
+// reads row bands of a map written by CVHDFS::write or write_map_bands
+class MapBandReader
+{
+public:
+	MapBandReader( const std::string &path, const std::string &name );
+	~MapBandReader();
+
+	cv::Size size() const { return map_size; }
+
+	// rows of a chunk, or zero if the dataset is not chunked
+	int band_rows() const { return chunk_rows; }
+
+	// band becomes the CV_32FC2 map rows [first_row, first_row+rows)
+	void read( int first_row, int rows, cv::Mat &band );
+
+private:
+	hid_t file;
+	hid_t dataset;
+	cv::Size map_size;
+	int chunk_rows;
+	bool identity_delta;
+};
+
+
+// CVHDFS::write under the lock map_io serializes the hdf5 library with, it is not thread safe in its
+// default build. use it instead of CVHDFS::write where other threads may use hdf5
+void write_dataset( const std::string &path, const std::string &name, const cv::Mat &mat );
+
+// reads a whole CV_32FC2 map written by CVHDFS::write or write_map_bands. use it instead of CVHDFS::read
+// for maps, it adds the identity back to identity_delta maps
+void read_map( const std::string &path, const std::string &name, cv::Mat &map );
+
+
+// remaps src into dst strip by strip, reading only the map rows of the current strip
+void remap_streaming(
+	const cv::Mat &src,
+	cv::Mat &dst,
+	MapBandReader &reader,
+	int strip_rows,
+	int interpolation = cv::INTER_LANCZOS4
+);
+
+
+// writes the span index next to the map, as the int datasets "spans" (spans, 2) and "span_rows" (rows+1),
+// with the frame size as attributes of "spans"
+void write_valid_spans( const std::string &path, const ValidSpans &spans );
+
+// false if the file has no span index
+bool read_valid_spans( const std::string &path, ValidSpans &spans );
+
+
+#endif // MAP_IO_H
@@ -0,0 +1,51 @@
+#ifndef MAP_VERIFY_H
+#define MAP_VERIFY_H
+
+#include <opencv2/opencv.hpp>
+
+#include "undistort.h"
+
+
+// how a map holds up against the forward model. errors are round trip errors in unwrapped pixels: how far
+// undistort of a map entry lands from the unwrapped point its pixel shows. the statistics are over the
+// pixels whose map entry is inside the frame, the rest is masked out anyway
+struct MapVerifyReport {
+	int pixels = 0;
+	int valid_pixels = 0;      // map entry inside the frame
+
+	double max_error = 0.0;
+	double mean_error = 0.0;
+	double median_error = 0.0;
+	double p99_error = 0.0;
+	double p999_error = 0.0;
+	cv::Point worst;           // the pixel of max_error
+
+	int non_converged = 0;       // pixels of an error over the tolerance, or of a non finite entry
+	int non_converged_valid = 0; // of those, the ones inside the frame
+
+	int mask_missing = 0;      // map entry inside the frame, but masked out
+	int mask_extra = 0;        // map entry outside the frame, but not masked out
+
+	cv::Mat error;             // CV_32FC1 round trip error of every pixel, infinite for non finite entries
+};
+
+/*
+	Checks a CV_32FC2 map of prepare_unwrap against the forward model, every pixel in parallel. grid is
+	the one the map was prepared for, see unwrap_grid. a pixel whose round trip error is over tolerance
+	didn't converge. mask is optional, if given it is compared with the map
+*/
+MapVerifyReport verify_map(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const UnwrapGrid &grid,
+	const cv::Mat &unwrap_map,
+	const cv::Mat &unwrap_mask = cv::Mat(),
+	double tolerance = 1e-3
+);
+
+// a BGR heatmap of the error of a report: blue is 1e-6 pixels or less, red is max_error or more, on a
+// logarithmic scale. non finite entries are white
+cv::Mat error_heatmap( const cv::Mat &error, double max_error );
+
+
+#endif // MAP_VERIFY_H
@@ -0,0 +1,64 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+
+
+// set from any thread to stop a long running call at its next checkpoint
+class CancellationToken
+{
+public:
+	CancellationToken() : cancelled(false) {}
+
+	void cancel() { cancelled = true; }
+	bool is_cancelled() const { return cancelled; }
+
+private:
+	std::atomic<bool> cancelled;
+};
+
+
+/*
+	Lets the caller observe and stop the long running library calls.
+	Everything is optional, a default constructed context is silent and can't be cancelled.
+	The callback may be called from worker threads.
+*/
+struct ProgressContext
+{
+	// stage name, fraction done in [0,1], estimated seconds left (negative if not known yet)
+	std::function<void(const std::string &stage, double fraction, double eta_seconds)> progress;
+
+	const CancellationToken *cancellation = nullptr;
+
+	// print the solver's own log and report to stdout
+	bool verbose = false;
+};
+
+
+// reports the progress of one stage of a call, estimating the time left from the time spent so far
+class ProgressReporter
+{
+public:
+	ProgressReporter( const ProgressContext *context, const std::string &stage );
+
+	void report( double fraction ) const;
+
+	bool cancelled() const;
+
+	bool verbose() const;
+
+private:
+	const ProgressContext *context;
+	std::string stage;
+	std::chrono::steady_clock::time_point start;
+};
+
+
+// prints the progress of every stage to stdout in 5% steps, for the command line tools
+ProgressContext console_progress( bool verbose );
+
+
+#endif // PROGRESS_H
@@ -0,0 +1,61 @@
+#ifndef REMAP_SERVICE_H
+#define REMAP_SERVICE_H
+
+#include <stdint.h>
+
+/*
+	Protocol between remap_server and its clients.
+
+	A client connects to the server's unix socket (SOCK_SEQPACKET, one message per packet) and sends
+	REMAP_ATTACH with a camera id, its frame geometry and the number of frames it wants in flight.
+	The server answers REMAP_ATTACHED with the name of a shared memory ring of slot_count slots.
+	Every slot holds an input frame followed by the output frame, both 8 bit, packed rows.
+	The client writes a frame into the input part of a free slot and sends REMAP_SUBMIT, the server
+	remaps it into the output part of the same slot, and answers REMAP_DONE. Until then the slot
+	belongs to the server. Errors are answered with REMAP_ERROR and a message, a failed remap also
+	with its slot, which is then free again. The frames have to be of the size the map was made for.
+*/
+
+#define REMAP_NAME_SIZE 64
+
+enum RemapMessageType {
+	REMAP_ATTACH = 1,
+	REMAP_ATTACHED = 2,
+	REMAP_SUBMIT = 3,
+	REMAP_DONE = 4,
+	REMAP_ERROR = 5
+};
+
+struct RemapMessage {
+	uint32_t type;
+
+	// REMAP_SUBMIT, REMAP_DONE, REMAP_ERROR of a failed remap
+	uint32_t slot;
+
+	// REMAP_ATTACH: camera id, REMAP_ERROR: error message
+	char camera[REMAP_NAME_SIZE];
+
+	// REMAP_ATTACH, echoed in REMAP_ATTACHED
+	uint32_t slot_count;
+	uint32_t input_width;
+	uint32_t input_height;
+	uint32_t channels;
+
+	// REMAP_ATTACHED
+	uint32_t output_width;
+	uint32_t output_height;
+	uint64_t slot_bytes;
+	char shm_name[REMAP_NAME_SIZE];
+};
+
+inline uint64_t remap_input_bytes( const RemapMessage &attached )
+{
+	return (uint64_t)attached.input_width * attached.input_height * attached.channels;
+}
+
+inline uint64_t remap_output_bytes( const RemapMessage &attached )
+{
+	return (uint64_t)attached.output_width * attached.output_height * attached.channels;
+}
+
+#endif // REMAP_SERVICE_H
@@ -0,0 +1,47 @@
+#ifndef STEREO_RECTIFIER_H
+#define STEREO_RECTIFIER_H
+
+#include <opencv2/opencv.hpp>
+
+#include "lanczos_remap.h"
+
+
+enum class StereoLayout {
+	SIDE_BY_SIDE,   // left eye on the left half, right eye on the right half
+	ROW_INTERLEAVED // even rows are the left eye, odd rows the right eye
+};
+
+
+/*
+	Rectifies a stereo pair into one grayscale buffer in a single parallel pass: the rows of both
+	eyes are split into bands, and every band is Lanczos remapped with the gray conversion done while
+	sampling, straight into its place in the output. Takes the map_left and map_right maps
+	stereo_calibration writes. rectify can be called from multiple threads concurrently, as long as
+	each thread has its own output.
+*/
+class StereoRectifier
+{
+public:
+	StereoRectifier( const cv::Mat &left_map, const cv::Mat &right_map, StereoLayout layout = StereoLayout::SIDE_BY_SIDE );
+
+	// of one eye
+	cv::Size eye_size() const { return left.output_size(); }
+
+	// of the fused buffer
+	cv::Size output_size() const;
+
+	// left and right are CV_8UC1 or CV_8UC3. output becomes CV_8UC1 of output_size(), it is
+	// (re)allocated only if its size or type doesn't match
+	void rectify( const cv::Mat &left_frame, const cv::Mat &right_frame, cv::Mat &output ) const;
+
+	// the part of output showing an eye, 0 is left, 1 is right
+	cv::Mat eye_view( cv::Mat &output, int eye ) const;
+
+private:
+	LanczosRemapper left;
+	LanczosRemapper right;
+	StereoLayout layout;
+};
+
+
+#endif // STEREO_RECTIFIER_H
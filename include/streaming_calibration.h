@@ -0,0 +1,74 @@
+#ifndef STREAMING_CALIBRATION_H
+#define STREAMING_CALIBRATION_H
+
+#include <functional>
+#include <random>
+
+#include <opencv2/opencv.hpp>
+
+#include "lines.h"
+#include "undistort.h"
+
+
+// what happened in one mini-batch of a StreamingCalibrator
+struct StreamingBatchReport {
+	int batch;
+	size_t lines_seen;
+	double undistorsion_factors[MODEL_SIZE];
+	double change[MODEL_SIZE]; // undistorsion_factors minus the estimate before the batch
+	double cost;               // final cost of the batch fit
+};
+
+struct StreamingCalibrationOptions {
+	size_t batch_size = 200;     // lines per mini-batch fit
+	size_t reservoir_size = 2000; // lines kept for the final refinement
+	int batch_iterations = 10;   // solver iterations of a mini-batch fit
+	unsigned int seed = 0;       // of the reservoir sampling
+
+	// called after every mini-batch fit
+	std::function<void(const StreamingBatchReport &)> batch_callback;
+};
+
+
+/*
+	Calibrates from an unbounded stream of lines with bounded memory. Lines are fitted in mini-batches,
+	each one warm-started from the current estimate with a few iterations, so the estimate follows the
+	stream. Meanwhile a uniform random sample of all the lines is kept (reservoir sampling), and finish
+	refines the estimate on it. Memory is batch_size + reservoir_size lines, however many lines arrive.
+*/
+class StreamingCalibrator
+{
+public:
+	StreamingCalibrator( cv::Size frame_size, const StreamingCalibrationOptions &options, const ProgressContext *context = nullptr );
+
+	// may run a mini-batch fit. returns false if it was cancelled
+	bool add( const Line &line );
+	bool add( const Lines &lines );
+
+	// fits what is left of the last batch, then refines on the reservoir. returns false if it was cancelled
+	bool finish( double undistorsion_factors[MODEL_SIZE] );
+
+	// the current estimate
+	const double *estimate() const { return undistorsion_factors; }
+
+	size_t lines_seen() const { return seen; }
+
+private:
+	bool fit_batch();
+
+	StreamingCalibrationOptions options;
+	const ProgressContext *context;
+
+	// batch fits are silent, but can be cancelled
+	ProgressContext batch_context;
+
+	double undistorsion_factors[MODEL_SIZE];
+	Lines batch;
+	Lines reservoir;
+	size_t seen;
+	int batches;
+	std::mt19937 random;
+};
+
+
+#endif // STREAMING_CALIBRATION_H
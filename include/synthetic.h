@@ -0,0 +1,36 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <opencv2/opencv.hpp>
+
+#include "undistort.h"
+
+
+// a frame of straight stripes, seen through a lens of known model
+struct StripeTarget {
+	cv::Size frame_size = cv::Size( 1280, 720 );
+	double undistorsion_factors[MODEL_SIZE] = { 640.0, 360.0, 0.0, 0.0 };
+
+	double period = 80.0;      // of the stripes, in undistorted pixels
+	double angle = 0.0;        // of the stripes, in radians
+	double phase = 0.0;        // shift of the stripes, in periods
+	double contrast = 160.0;   // gray level difference of the dark and bright stripes
+
+	double blur = 0.0;         // sigma of a gaussian blur in pixels, zero means sharp
+	double noise = 0.0;        // sigma of additive gaussian noise in gray levels
+	double vignetting = 0.0;   // brightness loss in the frame corners, 0 to 1
+};
+
+/*
+	Renders the target into a CV_8UC3 frame. Every frame pixel p shows the stripes at undistort(p),
+	so the distortion comes from the library's own model, and a perfect calibration recovers
+	undistorsion_factors. Stripe edges are antialiased by their distance to the pixel.
+*/
+void render_stripes( const StripeTarget &target, cv::Mat &frame, cv::RNG &rng );
+
+// the index-th frame of a sequence of count frames, with the stripes of base turned over half a circle
+// along the sequence and shifted randomly, so the lines run in every direction
+StripeTarget stripe_sequence_frame( const StripeTarget &base, int index, int count, cv::RNG &rng );
+
+
+#endif // SYNTHETIC_H
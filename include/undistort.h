@@ -1,9 +1,12 @@
 #ifndef UNDISTORT_H
 #define UNDISTORT_H
 
+#include <vector>
+
 #include <opencv2/opencv.hpp>
 
 #include "lines.h"
+#include "progress.h"
 
 #define MODEL_SIZE 4
 
@@ -13,28 +16,156 @@ cv::Point2d undistort(const double undistorsion_factors[MODEL_SIZE], cv::Point2d
 // this one is slow, on the order of 0.1 second or so
 cv::Point2d distort(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort );
 
+// the same as distort, but fast: newton iterations on the radius, as the model is radial.
+// converged is set to false if there is no solution, when the point is beyond the model's turning point.
+cv::Point2d distort_newton(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, bool *converged = nullptr );
+
+// the same two, starting from initial_guess instead of (0,0) and the undistorted radius. a nearby solution,
+// like the same pixel of the map of slightly different factors, makes them converge in an iteration or two
+cv::Point2d distort(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, cv::Point2d initial_guess );
+cv::Point2d distort_newton(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, cv::Point2d initial_guess, bool *converged = nullptr );
+
+// how the map generation inverts the model per pixel
+enum class InverseMethod {
+	SOLVER, // distort
+	NEWTON  // distort_newton
+};
+
+
+// the long running calls below take an optional context for progress reports and cancellation.
+// they return false if they were cancelled, their outputs are incomplete then. the fits also return false
+// if the solver failed, their factors are no calibration then.
 
 // this one is very slow (about 2 minutes for 500 lines on my machine)
-void fitUndistorsionModel( const Lines &lines, double undistorsion_factors[MODEL_SIZE], cv::Size frame_size );
+bool fitUndistorsionModel( const Lines &lines, double undistorsion_factors[MODEL_SIZE], cv::Size frame_size, const ProgressContext *context = nullptr );
+
+// the same fit, starting from the model already in undistorsion_factors instead of the no distortion guess.
+// max_num_iterations bounds the solver iterations, zero means the ceres default. final_cost is set if given,
+// and solved, to false if the solver failed. unlike the fits, only a cancellation returns false
+bool refineUndistorsionModel(
+	const Lines &lines,
+	double undistorsion_factors[MODEL_SIZE],
+	const ProgressContext *context = nullptr,
+	int max_num_iterations = 0,
+	double *final_cost = nullptr,
+	bool *solved = nullptr
+);
+
+
+// the residual the fit minimizes for one line: the mean distance of its undistorted points from the
+// straight line through its undistorted end points, in pixels. fast, nothing is optimized
+double line_straightness( const Line &line, const double undistorsion_factors[MODEL_SIZE] );
+
+// where the starts of fitUndistorsionModelMultiStart are
+struct MultiStartOptions {
+	int center_steps = 3;                    // centers per axis, on a grid
+	double center_spread = 0.1;              // farthest center offset from the frame center, relative to the frame size
+	std::vector<double> k1_seeds = { 0.0 };  // initial k1 times the squared half diagonal, so it doesn't depend on resolution
+
+	// every start runs dominance_iterations first, then the ones whose cost is over dominance_ratio times the
+	// lowest cost of all starts at that point are stopped. zero runs every start to the end
+	double dominance_ratio = 2.0;
+	int dominance_iterations = 5;
+};
+
+// fitUndistorsionModel from every start, as many concurrently as the opencv thread pool runs (none when called
+// from inside another parallel_for_), returns the one with the lowest cost.
+// the starts share the lines. slower than one fit, unless there are idle cores
+bool fitUndistorsionModelMultiStart(
+	const Lines &lines,
+	double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const MultiStartOptions &options,
+	const ProgressContext *context = nullptr
+);
+
+
+// the region of the undistorted plane covered by the unwrapped image. its top left corner is the
+// unwrapped pixel (0,0), so undistort(point) - tl() is where a frame point lands in the unwrapped image.
+// fast, on the order of undistort running time times frame perimeter
+cv::Rect2d unwrap_rectangle(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	double unwrap_factor
+);
+
+// which unwrapped points the output pixels show: output pixel (x,y) shows origin + (x*step.x, y*step.y)
+struct UnwrapGrid {
+	cv::Point2d origin;
+	cv::Point2d step;
+	cv::Size size;
+};
 
+// the grid of an unwrapped image cropped to roi (in unwrapped image pixels, empty means all of it)
+// and scaled to output_size (empty means the size of roi). fast, see unwrap_rectangle
+UnwrapGrid unwrap_grid(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	double unwrap_factor,
+	cv::Rect2d roi = cv::Rect2d(),
+	cv::Size output_size = cv::Size()
+);
+
+// this one is very slow, on the order of distort running time times undistorted image area,
+// divided by the number of cores. with InverseMethod::NEWTON it takes well under a second
+bool prepare_unwrap(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	double unwrap_factor,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context = nullptr,
+	InverseMethod inverse = InverseMethod::SOLVER
+);
 
-// this one is very slow, on the order of distort running time times undistorted image area
-void prepare_unwrap(
+// the same, for a cropped and/or scaled grid. the map has the final size, so the remap only does the
+// work needed for the output. downscaling is not prefiltered, keep it within about 2x
+bool prepare_unwrap(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const UnwrapGrid &grid,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context = nullptr,
+	InverseMethod inverse = InverseMethod::SOLVER
+);
+
+// regenerates the map of prepare_unwrap for undistorsion_factors, from the map of previous_factors already in
+// unwrap_map. every pixel starts from the previous solution of its unwrapped point, so small changes, like a
+// center tweak or a refit, take a fraction of prepare_unwrap. the buffers are reused if the size didn't change
+bool update_unwrap(
+	const double previous_factors[MODEL_SIZE],
 	const double undistorsion_factors[MODEL_SIZE],
 	cv::Size frame_size,
 	double unwrap_factor,
 	cv::Mat &unwrap_map,
-	cv::Mat &unwrap_mask
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context = nullptr,
+	InverseMethod inverse = InverseMethod::NEWTON
+);
+
+// the same for grids, previous_grid is the one unwrap_map was prepared for
+bool update_unwrap(
+	const UnwrapGrid &previous_grid,
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const UnwrapGrid &grid,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context = nullptr,
+	InverseMethod inverse = InverseMethod::NEWTON
 );
 
-// this one is very slow, on the order of distort running time times undistorted image area
-void concatenate_rectification_map_and_unwrap(
+// the same as prepare_unwrap, for every pixel of a rectification map
+bool concatenate_rectification_map_and_unwrap(
 	const double undistorsion_factors[MODEL_SIZE],
-	cv::Mat &rectification_map,
+	const cv::Mat &rectification_map,
 	cv::Size frame_size,
 	double unwrap_factor,
 	cv::Mat &unwrap_map,
-	cv::Mat &unwrap_mask
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context = nullptr,
+	InverseMethod inverse = InverseMethod::SOLVER
 );
 
 
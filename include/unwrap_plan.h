@@ -0,0 +1,116 @@
+#ifndef UNWRAP_PLAN_H
+#define UNWRAP_PLAN_H
+
+#include <memory>
+
+#include <opencv2/opencv.hpp>
+
+#include "undistort.h"
+#include "lanczos_remap.h"
+#include "valid_spans.h"
+
+
+enum class MapFormat {
+	FLOAT,       // CV_32FC2 map, exact
+	FIXED_POINT, // CV_16SC2 + CV_16UC1 maps (cv::convertMaps), faster remap, 1/32 pixel precision
+	LANCZOS_TABLE // precomputed Lanczos4 windows, see LanczosRemapper. 8 bit 1 and 3 channel frames only,
+	              // other frames and interpolations fall back to the exact map
+};
+
+
+// how an UnwrapPlan built from the lens model should look like. the defaults give what prepare_unwrap does
+struct UnwrapPlanOptions {
+	MapFormat format = MapFormat::FLOAT;
+	InverseMethod inverse = InverseMethod::SOLVER;
+	int interpolation = cv::INTER_LANCZOS4;
+
+	// region of the unwrapped image in its pixels, and the size it is scaled to. see unwrap_grid
+	cv::Rect2d roi;
+	cv::Size output_size;
+
+	// if given, the plan concatenates it with the unwrap, roi and output_size are not used then
+	cv::Mat rectification_map;
+
+	const ProgressContext *context = nullptr;
+};
+
+
+/*
+	Everything needed to unwrap frames of one camera, computed once.
+	Construction is slow (see prepare_unwrap), execute is cheap, allocation free once dst has the
+	right size, and can be called from multiple threads concurrently, as long as each thread has
+	its own dst.
+*/
+class UnwrapPlan
+{
+public:
+	// builds the map from the lens model
+	UnwrapPlan(
+		const double undistorsion_factors[MODEL_SIZE],
+		cv::Size frame_size,
+		double unwrap_factor,
+		const UnwrapPlanOptions &options = UnwrapPlanOptions()
+	);
+
+	// wraps an already computed CV_32FC2 map, like the one lens_undistort writes
+	UnwrapPlan(
+		const cv::Mat &unwrap_map,
+		MapFormat format = MapFormat::FLOAT,
+		int interpolation = cv::INTER_LANCZOS4
+	);
+
+	// regenerates the plan for slightly changed factors of the same camera, starting from the current map,
+	// see update_unwrap. only for plans built from the lens model without a rectification map, and not while
+	// execute runs. false if cancelled through the context, the plan is unusable then
+	bool update( const double undistorsion_factors[MODEL_SIZE], const ProgressContext *context = nullptr );
+
+	// false if the construction was cancelled through the context, the plan is unusable then
+	bool complete() const { return completed; }
+
+	cv::Size output_size() const { return unwrap_map.size(); }
+
+	// the unwrapped region the output pixels start from, empty if the plan wraps a precomputed map
+	cv::Rect2d rectangle() const { return unwrapped_rectangle; }
+
+	// which unwrapped points the output pixels show, not set if the plan wraps a precomputed map or rectifies
+	const UnwrapGrid &grid() const { return unwrap_grid; }
+
+	// always the CV_32FC2 map, whatever format execute uses
+	const cv::Mat &map() const { return unwrap_map; }
+
+	// empty if the plan wraps a precomputed map
+	const cv::Mat &mask() const { return unwrap_mask; }
+
+	// the output pixels that can show anything of a frame. computed by the lens model constructor,
+	// a plan wrapping a precomputed map has none until they are set
+	const ValidSpans &valid_spans() const { return spans; }
+	void set_valid_spans( const ValidSpans &spans );
+
+	// dst is (re)allocated only if its size or type doesn't match. with valid spans for the size of
+	// src, only the spans are remapped and the rest of dst is zeroed
+	void execute( const cv::Mat &src, cv::Mat &dst ) const;
+
+private:
+	void convert_map( MapFormat format );
+
+	// what the lens model constructor was given, for update. frame_size is empty for a precomputed map
+	cv::Size frame_size;
+	double unwrap_factor;
+	UnwrapPlanOptions options;
+
+	cv::Rect2d unwrapped_rectangle;
+	UnwrapGrid unwrap_grid;
+	cv::Mat unwrap_map;
+	cv::Mat unwrap_mask;
+	ValidSpans spans;
+
+	// the maps handed to cv::remap, in the chosen format
+	cv::Mat remap_map1;
+	cv::Mat remap_map2;
+	std::unique_ptr<LanczosRemapper> lanczos;
+	int interpolation;
+	bool completed;
+};
+
+
+#endif // UNWRAP_PLAN_H
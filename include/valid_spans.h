@@ -0,0 +1,31 @@
+#ifndef VALID_SPANS_H
+#define VALID_SPANS_H
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+
+/*
+	The runs of output pixels of a map that can show anything of a frame, row by row. The rest of the
+	output is outside the frame, remap fills it with the constant border. A pixel is valid if any tap
+	of its Lanczos4 window is inside the frame, which also covers the smaller windows of the other
+	interpolations, so remapping only the spans gives the same output.
+*/
+struct ValidSpans {
+	cv::Size frame_size;            // the spans are only valid for frames of this size
+	std::vector<cv::Vec2i> spans;   // (first column, length)
+	std::vector<int> row_offsets;   // the spans of row y are [row_offsets[y], row_offsets[y+1])
+
+	bool empty() const { return row_offsets.empty(); }
+	int rows() const { return empty() ? 0 : (int)row_offsets.size() - 1; }
+
+	// fraction of the output pixels in spans
+	double coverage( int cols ) const;
+};
+
+// from a CV_32FC2 map, for frames of frame_size
+ValidSpans valid_spans( const cv::Mat &map, cv::Size frame_size );
+
+
+#endif // VALID_SPANS_H
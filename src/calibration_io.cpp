@@ -0,0 +1,32 @@
+#include "calibration_io.h"
+
+
+void write_calibration( const std::string &filename, const double undistorsion_factors[MODEL_SIZE], cv::Size frame_size )
+{
+	cv::FileStorage fs(filename, cv::FileStorage::WRITE);
+	fs << "cx" << undistorsion_factors[0];
+	fs << "cy" << undistorsion_factors[1];
+	fs << "k1" << undistorsion_factors[2];
+	fs << "k2" << undistorsion_factors[3];
+
+	fs << "width" << frame_size.width;
+	fs << "height" << frame_size.height;
+	fs.release();
+}
+
+bool read_calibration( const std::string &filename, double undistorsion_factors[MODEL_SIZE], cv::Size &frame_size )
+{
+	cv::FileStorage fs(filename, cv::FileStorage::READ);
+	if( !fs.isOpened() )
+	{
+		return false;
+	}
+	fs["cx"] >> undistorsion_factors[0];
+	fs["cy"] >> undistorsion_factors[1];
+	fs["k1"] >> undistorsion_factors[2];
+	fs["k2"] >> undistorsion_factors[3];
+
+	fs["width"] >> frame_size.width;
+	fs["height"] >> frame_size.height;
+	return true;
+}
@@ -3,6 +3,8 @@
 
 #include "ceres/ceres.h"
 
+#include <cmath>
+
 
 struct UnDistorsionError {
 	UnDistorsionError( const double x_after, const double y_after, const double distorsion_factors[4] )
@@ -46,10 +48,15 @@ struct UnDistorsionError {
 };
 
 cv::Point2d distort(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort )
+{
+	return distort( undistorsion_factors, pointToDistort, cv::Point2d( 0.0, 0.0 ) );
+}
+
+cv::Point2d distort(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, cv::Point2d initial_guess )
 {
 	double point[2];
-	point[0] = 0.0;
-	point[1] = 0.0;
+	point[0] = initial_guess.x;
+	point[1] = initial_guess.y;
 
 	ceres::Problem problem;
 	ceres::CostFunction* cost_function = UnDistorsionError::Create( pointToDistort.x, pointToDistort.y, undistorsion_factors );
@@ -62,4 +69,89 @@ cv::Point2d distort(const double undistorsion_factors[MODEL_SIZE], cv::Point2d p
 	Solve(options, &problem, &summary);
 
 	return cv::Point2d( point[0], point[1] );
-}
\ No newline at end of file
+}
+
+/*
+	undistort moves a point radially: u - c = (d - c) * (1 + k1*r^2 + k2*r^4), where r = |d - c|.
+	So d lies on the ray from c through u, and only its radius r has to be found, the root of
+	f(r) = r * (1 + k1*r^2 + k2*r^4) - |u - c|. Newton converges in a few iterations from r = |u - c|,
+	and in one or two from the radius of a nearby solution.
+*/
+static cv::Point2d distort_radial(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, const cv::Point2d *initial_guess, bool *converged )
+{
+	const int max_iterations = 20;
+	const double tolerance = 1e-6;
+
+	cv::Point2d center( undistorsion_factors[0], undistorsion_factors[1] );
+	double k1 = undistorsion_factors[2];
+	double k2 = undistorsion_factors[3];
+
+	cv::Point2d offset = pointToDistort - center;
+	double undistorted_radius = std::sqrt( offset.dot( offset ) );
+	if( undistorted_radius==0.0 )
+	{
+		if( converged!=nullptr )
+		{
+			*converged = true;
+		}
+		return pointToDistort;
+	}
+
+	double r = undistorted_radius;
+	if( initial_guess!=nullptr )
+	{
+		cv::Point2d guess_offset = *initial_guess - center;
+		double guess_radius = std::sqrt( guess_offset.dot( guess_offset ) );
+		if( std::isfinite( guess_radius ) && guess_radius>0.0 )
+		{
+			r = guess_radius;
+		}
+	}
+
+	bool found = false;
+	for( int iteration=0; iteration<max_iterations; iteration++ )
+	{
+		double r2 = r*r;
+		double f = r * (1.0 + k1 * r2 + k2 * r2 * r2) - undistorted_radius;
+		if( std::abs( f )<tolerance )
+		{
+			found = true;
+			break;
+		}
+
+		double derivative = 1.0 + 3.0 * k1 * r2 + 5.0 * k2 * r2 * r2;
+		if( derivative<=0.0 )
+		{
+			// past the turning point of the model, there is no solution here
+			break;
+		}
+		r -= f / derivative;
+	}
+
+	if( converged!=nullptr )
+	{
+		*converged = found;
+	}
+	return center + offset * ( r / undistorted_radius );
+}
+
+cv::Point2d distort_newton(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, bool *converged )
+{
+	return distort_radial( undistorsion_factors, pointToDistort, nullptr, converged );
+}
+
+cv::Point2d distort_newton(const double undistorsion_factors[MODEL_SIZE], cv::Point2d pointToDistort, cv::Point2d initial_guess, bool *converged )
+{
+	bool found = false;
+	cv::Point2d point = distort_radial( undistorsion_factors, pointToDistort, &initial_guess, &found );
+	if( !found )
+	{
+		// a guess past the turning point doesn't find the root a cold start finds
+		point = distort_radial( undistorsion_factors, pointToDistort, nullptr, &found );
+	}
+	if( converged!=nullptr )
+	{
+		*converged = found;
+	}
+	return point;
+}
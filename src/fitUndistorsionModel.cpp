@@ -1,13 +1,15 @@
 #include "undistort.h"
 #include "undistort_internal.hpp"
 
-#include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "ceres/ceres.h"
 
-DEFINE_bool(details_calibration, true, "Should we print optimization info during calibration?");
+#include <algorithm>
+#include <atomic>
+#include <limits>
 
+// refers to the line, so the problems of concurrent fits can share the same lines
 struct LineStraigthnessError {
 	LineStraigthnessError( const Line &line )
 		: line(line) {};
@@ -49,24 +51,60 @@ struct LineStraigthnessError {
 
 	// Factory to hide the construction of the CostFunction object from
 	// the client code.
-	static ceres::CostFunction* Create(const Line line) {
+	static ceres::CostFunction* Create(const Line &line) {
 		return (new ceres::AutoDiffCostFunction<LineStraigthnessError, 1, 4>(
 			new LineStraigthnessError(line)));
 	}
 
-	const Line line;
+	const Line &line;
 };
 
 
-void fitUndistorsionModel( const Lines &lines, double undistorsion_factors[MODEL_SIZE], cv::Size frame_size )
+// forwards solver iterations to the progress reporter, and aborts the solve when cancelled
+class ProgressIterationCallback : public ceres::IterationCallback
 {
-	undistorsion_factors[0] = ((double)frame_size.width) / 2.0;
-	undistorsion_factors[1] = ((double)frame_size.height) / 2.0;
-	undistorsion_factors[2] = 0.0;
-	undistorsion_factors[3] = 0.0;
+public:
+	ProgressIterationCallback( const ProgressReporter &reporter, int max_num_iterations )
+		: reporter(reporter), max_num_iterations(max_num_iterations) {}
+
+	ceres::CallbackReturnType operator()( const ceres::IterationSummary &summary )
+	{
+		// the solver usually converges well before max_num_iterations, so this is an upper bound of the time left
+		reporter.report( std::min( 1.0, (double)summary.iteration / (double)max_num_iterations ) );
+
+		if( reporter.cancelled() )
+		{
+			return ceres::SOLVER_ABORT;
+		}
+		return ceres::SOLVER_CONTINUE;
+	}
+
+private:
+	const ProgressReporter &reporter;
+	int max_num_iterations;
+};
 
+
+double line_straightness( const Line &line, const double undistorsion_factors[MODEL_SIZE] )
+{
+	double residual;
+	LineStraigthnessError( line )( undistorsion_factors, &residual );
+	return residual;
+}
+
+
+// solves the problem over lines starting from undistorsion_factors
+static void solve_model(
+	const Lines &lines,
+	double undistorsion_factors[MODEL_SIZE],
+	int max_num_iterations,
+	bool verbose,
+	ceres::IterationCallback *callback,
+	ceres::Solver::Summary &summary
+)
+{
 	ceres::Problem problem;
-	for(Line line : lines )
+	for(const Line &line : lines )
 	{
 		ceres::CostFunction* cost_function = LineStraigthnessError::Create( line );
 		problem.AddResidualBlock( cost_function, nullptr, undistorsion_factors);
@@ -74,12 +112,226 @@ void fitUndistorsionModel( const Lines &lines, double undistorsion_factors[MODEL
 
 	ceres::Solver::Options options;
 	options.linear_solver_type = ceres::DENSE_SCHUR;
-	options.minimizer_progress_to_stdout = FLAGS_details_calibration;
+	options.minimizer_progress_to_stdout = verbose;
+	if( max_num_iterations>0 )
+	{
+		options.max_num_iterations = max_num_iterations;
+	}
+	options.callbacks.push_back( callback );
 
-	ceres::Solver::Summary summary;
 	Solve(options, &problem, &summary);
-	if( FLAGS_details_calibration )
+}
+
+bool refineUndistorsionModel( const Lines &lines, double undistorsion_factors[MODEL_SIZE], const ProgressContext *context, int max_num_iterations, double *final_cost, bool *solved )
+{
+	ProgressReporter reporter( context, "calibration" );
+
+	ProgressIterationCallback callback( reporter, max_num_iterations>0 ? max_num_iterations : ceres::Solver::Options().max_num_iterations );
+
+	ceres::Solver::Summary summary;
+	solve_model( lines, undistorsion_factors, max_num_iterations, reporter.verbose(), &callback, summary );
+	if( reporter.verbose() )
 	{
 		std::cout << summary.FullReport() << "\n";
 	}
-}
\ No newline at end of file
+	if( final_cost!=nullptr )
+	{
+		*final_cost = summary.final_cost;
+	}
+	if( solved!=nullptr )
+	{
+		*solved = summary.termination_type!=ceres::FAILURE;
+	}
+
+	return summary.termination_type!=ceres::USER_FAILURE;
+}
+
+bool fitUndistorsionModel( const Lines &lines, double undistorsion_factors[MODEL_SIZE], cv::Size frame_size, const ProgressContext *context )
+{
+	undistorsion_factors[0] = ((double)frame_size.width) / 2.0;
+	undistorsion_factors[1] = ((double)frame_size.height) / 2.0;
+	undistorsion_factors[2] = 0.0;
+	undistorsion_factors[3] = 0.0;
+
+	bool solved = false;
+	return refineUndistorsionModel( lines, undistorsion_factors, context, 0, nullptr, &solved ) && solved;
+}
+
+
+// one start of the multi-start fit
+struct FitStart {
+	double initial[MODEL_SIZE];
+	double undistorsion_factors[MODEL_SIZE];
+	double cost;
+	bool dominated;
+	bool finished;  // the solver stopped on its own, not at the iteration limit
+	bool failed;    // the solver gave up, the factors are no solution
+};
+
+// aborts a start when cancelled
+class CancelCallback : public ceres::IterationCallback
+{
+public:
+	explicit CancelCallback( const ProgressReporter &reporter ) : reporter(reporter) {}
+
+	ceres::CallbackReturnType operator()( const ceres::IterationSummary & )
+	{
+		return reporter.cancelled() ? ceres::SOLVER_ABORT : ceres::SOLVER_CONTINUE;
+	}
+
+private:
+	const ProgressReporter &reporter;
+};
+
+// runs every start that is neither dominated nor finished for up to max_num_iterations more, from where it stopped
+class MultiStartBody : public cv::ParallelLoopBody
+{
+public:
+	MultiStartBody( const Lines &lines, std::vector<FitStart> &starts, int max_num_iterations,
+		std::atomic<int> &solves_done, int solves, const ProgressReporter &reporter )
+		: lines(lines), starts(starts), max_num_iterations(max_num_iterations), solves_done(solves_done), solves(solves), reporter(reporter) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int i=range.start; i<range.end; i++ )
+		{
+			FitStart &start = starts[i];
+			if( !start.dominated && !start.finished && !start.failed )
+			{
+				CancelCallback callback( reporter );
+				ceres::Solver::Summary summary;
+				solve_model( lines, start.undistorsion_factors, max_num_iterations, false, &callback, summary );
+
+				start.cost = summary.final_cost;
+				start.finished = summary.termination_type!=ceres::NO_CONVERGENCE;
+				start.failed = summary.termination_type==ceres::FAILURE;
+			}
+			reporter.report( (double)++solves_done / solves );
+		}
+	}
+
+private:
+	const Lines &lines;
+	std::vector<FitStart> &starts;
+	int max_num_iterations;
+	std::atomic<int> &solves_done;
+	int solves;
+	const ProgressReporter &reporter;
+};
+
+bool fitUndistorsionModelMultiStart(
+	const Lines &lines,
+	double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const MultiStartOptions &options,
+	const ProgressContext *context
+)
+{
+	CHECK_GT( options.center_steps, 0 );
+	CHECK( !options.k1_seeds.empty() );
+	CHECK_GE( options.dominance_ratio, 1.0 ) << "the best start would be dominated too";
+
+	// k1 seeds are relative to the half diagonal, so they mean the same at any resolution
+	double half_diagonal2 = ( frame_size.width * frame_size.width + frame_size.height * frame_size.height ) / 4.0;
+
+	std::vector<FitStart> starts;
+	for( int y=0; y<options.center_steps; y++ )
+	{
+		for( int x=0; x<options.center_steps; x++ )
+		{
+			// offsets spread evenly over [-spread, spread], just the center for a single step
+			double offset_x = options.center_steps>1 ? options.center_spread * ( 2.0 * x / ( options.center_steps - 1 ) - 1.0 ) : 0.0;
+			double offset_y = options.center_steps>1 ? options.center_spread * ( 2.0 * y / ( options.center_steps - 1 ) - 1.0 ) : 0.0;
+			for( double k1_seed : options.k1_seeds )
+			{
+				FitStart start;
+				start.initial[0] = frame_size.width * ( 0.5 + offset_x );
+				start.initial[1] = frame_size.height * ( 0.5 + offset_y );
+				start.initial[2] = k1_seed / half_diagonal2;
+				start.initial[3] = 0.0;
+				std::copy( start.initial, start.initial + MODEL_SIZE, start.undistorsion_factors );
+				start.dominated = false;
+				start.finished = false;
+				start.failed = false;
+				starts.push_back( start );
+			}
+		}
+	}
+
+	int max_num_iterations = ceres::Solver::Options().max_num_iterations;
+	bool prune = options.dominance_iterations>0 && options.dominance_iterations<max_num_iterations;
+	int solves = ( prune ? 2 : 1 ) * starts.size();
+
+	ProgressReporter reporter( context, "multi-start calibration" );
+	std::atomic<int> solves_done( 0 );
+
+	// one stripe per start, so the pool may run every start at once. there is no thread per start though: the
+	// stripes share the pool's threads, and they run one after the other if this is called from inside another
+	// parallel_for_, like the manifest mode's CalibrateGroupBody. the solves are sequential inside a start
+	if( prune )
+	{
+		// every start runs dominance_iterations first, so the starts are compared at the same iteration, however
+		// they were scheduled. the ones far above the best of them stop there, the others go on
+		cv::parallel_for_( cv::Range( 0, starts.size() ), MultiStartBody( lines, starts, options.dominance_iterations, solves_done, solves, reporter ), starts.size() );
+		if( reporter.cancelled() )
+		{
+			return false;
+		}
+
+		double best_cost = std::numeric_limits<double>::max();
+		for( const FitStart &start : starts )
+		{
+			if( !start.failed )
+			{
+				best_cost = std::min( best_cost, start.cost );
+			}
+		}
+		for( FitStart &start : starts )
+		{
+			start.dominated = start.cost>best_cost*options.dominance_ratio;
+		}
+		max_num_iterations -= options.dominance_iterations;
+	}
+	cv::parallel_for_( cv::Range( 0, starts.size() ), MultiStartBody( lines, starts, max_num_iterations, solves_done, solves, reporter ), starts.size() );
+
+	if( reporter.cancelled() )
+	{
+		return false;
+	}
+
+	const FitStart *best = nullptr;
+	for( const FitStart &start : starts )
+	{
+		if( !start.dominated && !start.failed && ( best==nullptr || start.cost<best->cost ) )
+		{
+			best = &start;
+		}
+	}
+
+	if( reporter.verbose() )
+	{
+		for( const FitStart &start : starts )
+		{
+			std::cout << "start cx " << start.initial[0] << " cy " << start.initial[1] << " k1 " << start.initial[2] << ": ";
+			if( start.failed )
+			{
+				std::cout << "solver failed" << std::endl;
+			}
+			else if( start.dominated )
+			{
+				std::cout << "dominated, stopped" << std::endl;
+			}
+			else
+			{
+				std::cout << "cost " << start.cost << ( &start==best ? ", best" : "" ) << std::endl;
+			}
+		}
+	}
+
+	if( best==nullptr )
+	{
+		return false;
+	}
+	std::copy( best->undistorsion_factors, best->undistorsion_factors + MODEL_SIZE, undistorsion_factors );
+	return true;
+}
@@ -0,0 +1,238 @@
+#include "lanczos_remap.h"
+
+#include "glog/logging.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+// the 8 Lanczos4 weights of a window starting 3 pixels left of the pixel, for fractional position x,
+// computed the same way as cv::remap does it
+static void lanczos4_weights( double x, float weights[LanczosRemapper::TAPS] )
+{
+	const double s45 = 0.70710678118654752440084436210485;
+	const double cs[][2] = { {1, 0}, {-s45, -s45}, {0, 1}, {s45, -s45}, {-1, 0}, {s45, s45}, {0, -1}, {-s45, s45} };
+
+	if( x<FLT_EPSILON )
+	{
+		std::fill( weights, weights + LanczosRemapper::TAPS, 0.0f );
+		weights[3] = 1.0f;
+		return;
+	}
+
+	double y0 = -(x + 3) * CV_PI * 0.25;
+	double s0 = sin( y0 );
+	double c0 = cos( y0 );
+	double raw[LanczosRemapper::TAPS];
+	double sum = 0;
+	for( int i=0; i<LanczosRemapper::TAPS; i++ )
+	{
+		double y = -(x + 3 - i) * CV_PI * 0.25;
+		raw[i] = ( cs[i][0] * s0 + cs[i][1] * c0 ) / ( y * y );
+		sum += raw[i];
+	}
+	for( int i=0; i<LanczosRemapper::TAPS; i++ )
+	{
+		weights[i] = (float)( raw[i] / sum );
+	}
+}
+
+
+LanczosRemapper::LanczosRemapper( const cv::Mat &map )
+	: map_size(map.size()), taps(map.total())
+{
+	CHECK_EQ( map.type(), CV_32FC2 ) << "map should be CV_32FC2";
+
+	for( int i=0; i<TABLE_SIZE; i++ )
+	{
+		lanczos4_weights( (double)i / TABLE_SIZE, weights[i] );
+	}
+
+	// positions far outside of any frame are clamped, they stay outside after that
+	const int lowest = -TAPS;
+	const int highest = INT16_MAX - TAPS;
+
+	for( int y=0; y<map.rows; y++ )
+	{
+		const cv::Vec2f *row = map.ptr<cv::Vec2f>(y);
+		Tap *tap = &taps[y * map.cols];
+		for( int x=0; x<map.cols; x++ )
+		{
+			float source_x = row[x][0];
+			float source_y = row[x][1];
+			if( !std::isfinite( source_x ) || !std::isfinite( source_y ) )
+			{
+				source_x = source_y = (float)lowest;
+			}
+			source_x = std::min( std::max( source_x, (float)lowest ), (float)highest );
+			source_y = std::min( std::max( source_y, (float)lowest ), (float)highest );
+
+			int fixed_x = cvRound( source_x * TABLE_SIZE );
+			int fixed_y = cvRound( source_y * TABLE_SIZE );
+			tap[x].x = (int16_t)( ( fixed_x >> TABLE_BITS ) - 3 );
+			tap[x].y = (int16_t)( ( fixed_y >> TABLE_BITS ) - 3 );
+			tap[x].fx = (uint8_t)( fixed_x & ( TABLE_SIZE - 1 ) );
+			tap[x].fy = (uint8_t)( fixed_y & ( TABLE_SIZE - 1 ) );
+		}
+	}
+}
+
+
+// BGR to gray weights of cv::COLOR_BGR2GRAY
+static const float GRAY_WEIGHTS[3] = { 0.114f, 0.587f, 0.299f };
+
+// one output pixel. INSIDE means the whole window is in the frame, otherwise the missing pixels count as zero.
+// with GRAY the CN channels of a source pixel are mixed into one while sampled, which gives the same as
+// converting after the remap, as both are linear
+template <int CN, bool GRAY, bool INSIDE>
+static inline void sample(
+	const cv::Mat &src,
+	const LanczosRemapper::Tap &t,
+	const float *wx,
+	const float *wy,
+	uchar *out
+)
+{
+	const int N = LanczosRemapper::TAPS;
+	const int OUT = GRAY ? 1 : CN;
+	float sum[OUT] = {};
+
+	for( int r=0; r<N; r++ )
+	{
+		int source_y = t.y + r;
+		if( !INSIDE && ( source_y<0 || source_y>=src.rows ) )
+		{
+			continue;
+		}
+		const uchar *row = src.ptr<uchar>( source_y );
+		float horizontal[OUT] = {};
+		for( int k=0; k<N; k++ )
+		{
+			int source_x = t.x + k;
+			if( !INSIDE && ( source_x<0 || source_x>=src.cols ) )
+			{
+				continue;
+			}
+			const uchar *pixel = row + source_x * CN;
+			if( GRAY && CN==3 )
+			{
+				horizontal[0] += wx[k] * ( GRAY_WEIGHTS[0] * pixel[0] + GRAY_WEIGHTS[1] * pixel[1] + GRAY_WEIGHTS[2] * pixel[2] );
+			}
+			else
+			{
+				for( int c=0; c<OUT; c++ )
+				{
+					horizontal[c] += wx[k] * pixel[c];
+				}
+			}
+		}
+		for( int c=0; c<OUT; c++ )
+		{
+			sum[c] += wy[r] * horizontal[c];
+		}
+	}
+
+	for( int c=0; c<OUT; c++ )
+	{
+		out[c] = cv::saturate_cast<uchar>( sum[c] );
+	}
+}
+
+/*
+	Remaps the cols of rows of dst. A window fully inside the frame takes the fast path, 8 rows of
+	8 taps with no checks. The few windows over the frame border take the checked one.
+*/
+template <int CN, bool GRAY>
+static void remap_rows(
+	const cv::Mat &src,
+	cv::Mat &dst,
+	cv::Range rows,
+	cv::Range cols,
+	const LanczosRemapper::Tap *taps,
+	const float (*weights)[LanczosRemapper::TAPS]
+)
+{
+	const int N = LanczosRemapper::TAPS;
+	const int OUT = GRAY ? 1 : CN;
+
+	for( int y=rows.start; y<rows.end; y++ )
+	{
+		const LanczosRemapper::Tap *tap = taps + y * dst.cols;
+		uchar *out = dst.ptr<uchar>(y) + cols.start * OUT;
+
+		for( int x=cols.start; x<cols.end; x++, out+=OUT )
+		{
+			const LanczosRemapper::Tap &t = tap[x];
+			if( t.x>=0 && t.y>=0 && t.x+N<=src.cols && t.y+N<=src.rows )
+			{
+				sample<CN, GRAY, true>( src, t, weights[t.fx], weights[t.fy], out );
+			}
+			else
+			{
+				sample<CN, GRAY, false>( src, t, weights[t.fx], weights[t.fy], out );
+			}
+		}
+	}
+}
+
+
+class LanczosRemapBody : public cv::ParallelLoopBody
+{
+public:
+	LanczosRemapBody( const LanczosRemapper &remapper, const cv::Mat &src, cv::Mat &dst )
+		: remapper(remapper), src(src), dst(dst) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		remapper.execute_rows( src, dst, range );
+	}
+
+private:
+	const LanczosRemapper &remapper;
+	const cv::Mat &src;
+	cv::Mat &dst;
+};
+
+
+void LanczosRemapper::execute( const cv::Mat &src, cv::Mat &dst ) const
+{
+	CHECK( supports( src ) ) << "only CV_8UC1 and CV_8UC3 frames are supported";
+	CHECK( src.data!=dst.data ) << "can't remap in place";
+
+	dst.create( map_size, src.type() );
+	cv::parallel_for_( cv::Range( 0, dst.rows ), LanczosRemapBody( *this, src, dst ) );
+}
+
+void LanczosRemapper::execute_gray( const cv::Mat &src, cv::Mat &dst ) const
+{
+	CHECK( supports( src ) ) << "only CV_8UC1 and CV_8UC3 frames are supported";
+	CHECK( src.data!=dst.data ) << "can't remap in place";
+
+	dst.create( map_size, CV_8UC1 );
+	cv::parallel_for_( cv::Range( 0, dst.rows ), LanczosRemapBody( *this, src, dst ) );
+}
+
+void LanczosRemapper::execute_rows( const cv::Mat &src, cv::Mat &dst, cv::Range rows ) const
+{
+	execute_block( src, dst, rows, cv::Range( 0, map_size.width ) );
+}
+
+void LanczosRemapper::execute_block( const cv::Mat &src, cv::Mat &dst, cv::Range rows, cv::Range cols ) const
+{
+	CHECK( dst.size()==map_size ) << "dst should be allocated";
+	CHECK( dst.type()==src.type() || dst.type()==CV_8UC1 ) << "dst should be of the type of src, or CV_8UC1";
+	CHECK( 0<=cols.start && cols.start<=cols.end && cols.end<=map_size.width ) << "cols out of the map";
+
+	if( src.channels()==1 )
+	{
+		remap_rows<1, false>( src, dst, rows, cols, taps.data(), weights );
+	}
+	else if( dst.channels()==1 )
+	{
+		remap_rows<3, true>( src, dst, rows, cols, taps.data(), weights );
+	}
+	else
+	{
+		remap_rows<3, false>( src, dst, rows, cols, taps.data(), weights );
+	}
+}
@@ -0,0 +1,198 @@
+#include "line_cache.h"
+
+#include "glog/logging.h"
+
+#include <sys/stat.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+
+static const char LINE_CACHE_MAGIC[8] = { 'L', 'I', 'N', 'E', 'S', 'v', '1', '\n' };
+
+
+static void put_varint( std::vector<uint8_t> &buffer, uint64_t value )
+{
+	while( value>=0x80 )
+	{
+		buffer.push_back( (uint8_t)( value | 0x80 ) );
+		value >>= 7;
+	}
+	buffer.push_back( (uint8_t)value );
+}
+
+static uint64_t zigzag( int64_t value )
+{
+	return ( (uint64_t)value << 1 ) ^ (uint64_t)( value >> 63 );
+}
+
+static int64_t unzigzag( uint64_t value )
+{
+	return (int64_t)( value >> 1 ) ^ -(int64_t)( value & 1 );
+}
+
+
+// reads the varints of a cache file, stops with an error at the end of the data
+class VarintReader
+{
+public:
+	VarintReader( const std::vector<uint8_t> &buffer, size_t position, const std::string &path )
+		: buffer(buffer), position(position), path(path) {}
+
+	uint64_t varint()
+	{
+		uint64_t value = 0;
+		for( int shift=0; ; shift+=7 )
+		{
+			CHECK_LT( position, buffer.size() ) << path << " is truncated";
+			CHECK_LT( shift, 64 ) << path << " is damaged";
+			uint8_t byte = buffer[position++];
+			value |= (uint64_t)( byte & 0x7f ) << shift;
+			if( ( byte & 0x80 )==0 )
+			{
+				return value;
+			}
+		}
+	}
+
+	int64_t signed_varint() { return unzigzag( varint() ); }
+
+	std::string bytes( size_t size )
+	{
+		CHECK_LE( size, buffer.size() - position ) << path << " is truncated";
+		std::string value( (const char*)&buffer[position], size );
+		position += size;
+		return value;
+	}
+
+	bool at_end() const { return position==buffer.size(); }
+
+private:
+	const std::vector<uint8_t> &buffer;
+	size_t position;
+	const std::string &path;
+};
+
+
+void write_line_cache( const std::string &path, const LineCache &cache )
+{
+	std::vector<uint8_t> buffer( LINE_CACHE_MAGIC, LINE_CACHE_MAGIC + sizeof(LINE_CACHE_MAGIC) );
+
+	put_varint( buffer, cache.frame_size.width );
+	put_varint( buffer, cache.frame_size.height );
+
+	put_varint( buffer, cache.sources.size() );
+	for( const std::string &source : cache.sources )
+	{
+		put_varint( buffer, source.size() );
+		buffer.insert( buffer.end(), source.begin(), source.end() );
+	}
+
+	put_varint( buffer, cache.lines.size() );
+	for( const Line &line : cache.lines )
+	{
+		put_varint( buffer, line.size() );
+		cv::Point previous( 0, 0 );
+		for( const cv::Point &point : line )
+		{
+			put_varint( buffer, zigzag( point.x - previous.x ) );
+			put_varint( buffer, zigzag( point.y - previous.y ) );
+			previous = point;
+		}
+	}
+
+	std::ofstream file( path, std::ios::binary );
+	CHECK( file.is_open() ) << "can't write " << path;
+	file.write( (const char*)buffer.data(), buffer.size() );
+	CHECK( file.good() ) << "can't write " << path;
+}
+
+bool read_line_cache( const std::string &path, LineCache &cache )
+{
+	std::ifstream file( path, std::ios::binary );
+	if( !file.is_open() )
+	{
+		return false;
+	}
+
+	char magic[sizeof(LINE_CACHE_MAGIC)];
+	if( !file.read( magic, sizeof(magic) ) || memcmp( magic, LINE_CACHE_MAGIC, sizeof(magic) )!=0 )
+	{
+		return false;
+	}
+	std::vector<uint8_t> buffer( ( std::istreambuf_iterator<char>( file ) ), std::istreambuf_iterator<char>() );
+	VarintReader reader( buffer, 0, path );
+
+	cache.frame_size.width = reader.varint();
+	cache.frame_size.height = reader.varint();
+
+	uint64_t source_count = reader.varint();
+	// every source is at least its length byte
+	CHECK_LE( source_count, buffer.size() ) << path << " is damaged";
+	cache.sources.resize( source_count );
+	for( std::string &source : cache.sources )
+	{
+		source = reader.bytes( reader.varint() );
+	}
+
+	uint64_t line_count = reader.varint();
+	// every point is at least two bytes, which bounds the counts of a damaged file
+	CHECK_LE( line_count, buffer.size() ) << path << " is damaged";
+	cache.lines.resize( line_count );
+	for( Line &line : cache.lines )
+	{
+		uint64_t point_count = reader.varint();
+		CHECK_LE( point_count, buffer.size() ) << path << " is damaged";
+		line.resize( point_count );
+		cv::Point previous( 0, 0 );
+		for( cv::Point &point : line )
+		{
+			point.x = previous.x + reader.signed_varint();
+			point.y = previous.y + reader.signed_varint();
+			previous = point;
+		}
+	}
+	CHECK( reader.at_end() ) << path << " has trailing data";
+
+	return true;
+}
+
+std::string source_fingerprint( const std::string &path )
+{
+	std::stringstream fingerprint;
+	fingerprint << path;
+
+	struct stat info;
+	if( stat( path.c_str(), &info )==0 )
+	{
+		fingerprint << " " << info.st_size << " " << info.st_mtime;
+	}
+	return fingerprint.str();
+}
+
+bool merge_line_cache( LineCache &into, const LineCache &from )
+{
+	if( into.lines.empty() && into.sources.empty() )
+	{
+		into.frame_size = from.frame_size;
+	}
+	CHECK( into.frame_size==from.frame_size ) << "line caches of different resolutions (" << into.frame_size << " and " << from.frame_size << ") can't be merged";
+
+	// the lines aren't kept per source, so a cache that shares only some of its sources can't be merged
+	// without counting the lines of the shared ones twice
+	size_t shared = std::count_if( from.sources.begin(), from.sources.end(), [&]( const std::string &source ) {
+		return std::find( into.sources.begin(), into.sources.end(), source )!=into.sources.end();
+	});
+	if( shared>0 && shared==from.sources.size() )
+	{
+		return false;
+	}
+	CHECK_EQ( shared, 0u ) << "line caches sharing only some of their sources can't be merged, the lines of the shared ones would count twice";
+
+	into.sources.insert( into.sources.end(), from.sources.begin(), from.sources.end() );
+	into.lines.insert( into.lines.end(), from.lines.begin(), from.lines.end() );
+	return true;
+}
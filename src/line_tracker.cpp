@@ -0,0 +1,267 @@
+#include "line_tracker.h"
+
+#include "glog/logging.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+// points of a line compared by line_distance
+static const int DISTANCE_SAMPLES = 16;
+
+
+static double point_segment_distance( cv::Point2d p, cv::Point2d a, cv::Point2d b )
+{
+	cv::Point2d ab = b - a;
+	double length2 = ab.dot( ab );
+	double t = length2>0.0 ? std::min( std::max( ( p - a ).dot( ab ) / length2, 0.0 ), 1.0 ) : 0.0;
+	cv::Point2d d = p - ( a + ab * t );
+	return std::sqrt( d.dot( d ) );
+}
+
+// mean distance of evenly spaced points of a from the polyline b
+static double line_distance( const Line &a, const Line &b )
+{
+	if( a.empty() || b.empty() )
+	{
+		return std::numeric_limits<double>::infinity();
+	}
+
+	int samples = std::min( (int)a.size(), DISTANCE_SAMPLES );
+	double sum = 0.0;
+	for( int s=0; s<samples; s++ )
+	{
+		cv::Point2d p = a[ samples>1 ? s * ( a.size() - 1 ) / ( samples - 1 ) : 0 ];
+		double nearest = point_segment_distance( p, b.front(), b.front() );
+		for( size_t i=1; i<b.size(); i++ )
+		{
+			nearest = std::min( nearest, point_segment_distance( p, b[i-1], b[i] ) );
+		}
+		sum += nearest;
+	}
+	return sum / samples;
+}
+
+// unit direction of the line at point i, from its neighbours
+static cv::Point2d line_direction( const Line &line, size_t i )
+{
+	cv::Point2d d = line[ std::min( i + 1, line.size() - 1 ) ] - line[ i>0 ? i - 1 : 0 ];
+	double length = std::sqrt( d.dot( d ) );
+	return length>0.0 ? d * ( 1.0 / length ) : cv::Point2d( 0.0, 0.0 );
+}
+
+// the gray level at point + normal*t, averaged with its neighbours along the line. negative outside the frame
+static double profile_sample( const cv::Mat &gray, cv::Point2d point, cv::Point2d tangent, cv::Point2d normal, int t )
+{
+	double sum = 0.0;
+	for( int k=-1; k<=1; k++ )
+	{
+		cv::Point2d p = point + normal * t + tangent * k;
+		int x = cvRound( p.x );
+		int y = cvRound( p.y );
+		if( x<0 || y<0 || x>=gray.cols || y>=gray.rows )
+		{
+			return -1.0;
+		}
+		sum += gray.at<uchar>( y, x );
+	}
+	return sum / 3.0;
+}
+
+// the gray level difference over 2 pixels across the line at point + normal*t, positive if it gets brighter
+// along the normal. NaN if it is out of the frame
+static double edge_strength( const cv::Mat &gray, cv::Point2d point, cv::Point2d tangent, cv::Point2d normal, int t )
+{
+	double before = profile_sample( gray, point, tangent, normal, t - 1 );
+	double after = profile_sample( gray, point, tangent, normal, t + 1 );
+	if( before<0.0 || after<0.0 )
+	{
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	return after - before;
+}
+
+// the normal points to the left of the line, like in good_contrast
+static cv::Point2d line_normal( cv::Point2d tangent )
+{
+	return cv::Point2d( tangent.y, -tangent.x );
+}
+
+
+LineTracker::LineTracker( const LineTrackerOptions &options )
+	: options(options), frame_count(0), keyframe_count(0)
+{
+	CHECK_GT( options.point_step, 0 ) << "point_step should be positive";
+	CHECK_GT( options.search_radius, 0 ) << "search_radius should be positive";
+	reset();
+}
+
+void LineTracker::reset()
+{
+	tracks.clear();
+	lost.clear();
+	detected_count = 0;
+	frame_size = cv::Size();
+	frames_since_keyframe = 0;
+}
+
+bool LineTracker::follow( const cv::Mat &gray, Track &track ) const
+{
+	const Line &line = track.line;
+	Line moved;
+	moved.reserve( line.size() );
+
+	for( size_t i=0; i<line.size(); i++ )
+	{
+		cv::Point2d tangent = line_direction( line, i );
+		cv::Point2d normal = line_normal( tangent );
+		cv::Point2d point( line[i] );
+
+		// the strongest edge of the right direction near the previous position
+		double best = options.min_edge_strength;
+		int best_t = 0;
+		bool found = false;
+		for( int t=-options.search_radius; t<=options.search_radius; t++ )
+		{
+			// NaN compares false, so points out of the frame are never found
+			double strength = track.polarity * edge_strength( gray, point, tangent, normal, t );
+			if( strength>best || ( strength==best && !found ) )
+			{
+				best = strength;
+				best_t = t;
+				found = true;
+			}
+		}
+		if( !found )
+		{
+			continue;
+		}
+
+		cv::Point2d next = point + normal * best_t;
+		cv::Point rounded( cvRound( next.x ), cvRound( next.y ) );
+		if( moved.empty() || moved.back()!=rounded )
+		{
+			moved.push_back( rounded );
+		}
+	}
+
+	if( moved.size()<2 || moved.size()<options.min_found_ratio * line.size() )
+	{
+		return false;
+	}
+	track.line.swap( moved );
+	return true;
+}
+
+void LineTracker::detect( const cv::Mat &frame, const cv::Mat &gray, Lines &lines )
+{
+	Lines detected;
+	extract_lines( frame, detected );
+
+	// where the lines known until now were passed on last, tracked or lost since
+	Lines emitted;
+	emitted.swap( lost );
+	for( Track &track : tracks )
+	{
+		emitted.push_back( std::move( track.emitted ) );
+	}
+	tracks.clear();
+
+	for( Line &line : detected )
+	{
+		Track track;
+		for( size_t i=0; i<line.size(); i+=options.point_step )
+		{
+			track.line.push_back( line[i] );
+		}
+		if( track.line.back()!=line.back() )
+		{
+			track.line.push_back( line.back() );
+		}
+
+		// the contour is on the edge, so its direction shows at offset zero
+		double mean_strength = 0.0;
+		for( size_t i=0; i<track.line.size(); i++ )
+		{
+			cv::Point2d tangent = line_direction( track.line, i );
+			double strength = edge_strength( gray, track.line[i], tangent, line_normal( tangent ), 0 );
+			if( !std::isnan( strength ) )
+			{
+				mean_strength += strength;
+			}
+		}
+		track.polarity = mean_strength>=0.0 ? 1 : -1;
+
+		// a line seen already is passed on only if it moved enough since
+		auto seen = std::find_if( emitted.begin(), emitted.end(), [&]( const Line &e ) {
+			return line_distance( track.line, e )<options.min_motion;
+		});
+		if( seen!=emitted.end() )
+		{
+			track.emitted = *seen;
+		}
+		else
+		{
+			track.emitted = track.line;
+			lines.push_back( line );
+		}
+		tracks.push_back( std::move( track ) );
+	}
+	detected_count = tracks.size();
+}
+
+bool LineTracker::track( const cv::Mat &frame, Lines &lines )
+{
+	CHECK_EQ( frame.type(), CV_8UC3 ) << "frames should be BGR";
+
+	if( frame.size()!=frame_size )
+	{
+		reset();
+		frame_size = frame.size();
+	}
+	frame_count++;
+
+	// the same conversion extract_lines does
+	cv::Mat gray;
+	cv::cvtColor( frame, gray, cv::COLOR_RGB2GRAY );
+
+	bool keyframe = tracks.empty() || ( options.keyframe_interval>0 && frames_since_keyframe>=options.keyframe_interval );
+	if( !keyframe )
+	{
+		std::vector<Track> followed;
+		followed.reserve( tracks.size() );
+		for( Track &track : tracks )
+		{
+			if( follow( gray, track ) )
+			{
+				followed.push_back( std::move( track ) );
+			}
+			else
+			{
+				lost.push_back( std::move( track.emitted ) );
+			}
+		}
+		tracks.swap( followed );
+		keyframe = tracks.size()<options.min_tracked_ratio * detected_count;
+	}
+
+	if( keyframe )
+	{
+		detect( frame, gray, lines );
+		frames_since_keyframe = 0;
+		keyframe_count++;
+		return true;
+	}
+
+	for( Track &track : tracks )
+	{
+		if( line_distance( track.line, track.emitted )>=options.min_motion )
+		{
+			lines.push_back( track.line );
+			track.emitted = track.line;
+		}
+	}
+	frames_since_keyframe++;
+	return false;
+}
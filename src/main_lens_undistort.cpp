@@ -2,28 +2,71 @@
 #include "glog/logging.h"
 
 #include <glob.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <set>
+#include <sstream>
 
 #include <opencv2/opencv.hpp>
 
-#include "opencvhdfs.h"
+#include "map_io.h"
 
 #include "lines.h"
 #include "undistort.h"
+#include "calibration_io.h"
+#include "streaming_calibration.h"
+#include "line_cache.h"
+#include "line_tracker.h"
 
 #include "version.h"
 
 #define USAGE_MESSAGE "lets you calibrate lens distortion of your camera."
 
-DEFINE_string(input, "", "Glob pattern for input videos or frames");
+DEFINE_string(input, "", "Glob pattern for input videos or frames, or line caches written with output_lines. More line caches are merged.");
+DEFINE_string(output_lines, "", "Path to save the extracted lines to, so they can be refitted later without decoding the inputs again.");
+DEFINE_string(manifest, "", "Calibrates many cameras at once: a file of 'camera_id glob_pattern' lines. Inputs are grouped by camera and resolution, each group gets an xml and an hdf5 in output_dir, plus a summary.yml. max_line_count applies per camera.");
+DEFINE_string(output_dir, "", "Output directory of the manifest mode.");
 DEFINE_int64(max_line_count, 500, "Line extraction will be terminated after this much lines. Zero means all lines will be extracted.");
 DEFINE_bool(visual_confirm, false, "Should every line be confirmed throught a ui?");
 DEFINE_string(output_xml, "", "Path for xml or yaml output.");
 DEFINE_string(output_hdf5, "", "Path for unwrapping matrix.");
 DEFINE_double(unwrap_factor, 1.0, "How big the unwrapped image should be? 0=only valid pixels  1=whole frame unwrapped");
-
-
-void process_frame( cv::Mat frame, Lines &lines )
+DEFINE_bool(details_calibration, true, "Should we print optimization info during calibration?");
+DEFINE_int64(hdf5_band_rows, 0, "Store the unwrapping matrix chunked in bands of this many rows, so it can be streamed. Zero means one monolithic dataset.");
+DEFINE_int64(hdf5_deflate, 0, "Deflate level (0-9) of the chunked unwrapping matrix. Zero means no compression.");
+DEFINE_int64(streaming_batch, 0, "Calibrate while the lines are extracted, in mini-batches of this many lines, so memory doesn't grow with the number of lines. Best used with max_line_count=0. Zero means all lines are collected and fitted at once.");
+DEFINE_int64(reservoir_size, 2000, "With streaming_batch, the final fit is refined on a random sample of this many lines.");
+DEFINE_bool(multistart, false, "Fit from a grid of initial centers and k1 values concurrently, and keep the best. Helps strongly distorted lenses out of poor local minima.");
+DEFINE_int64(multistart_center_steps, 3, "Initial centers per axis of the multi-start fit.");
+DEFINE_double(multistart_center_spread, 0.1, "Farthest initial center offset of the multi-start fit, relative to the frame size.");
+DEFINE_string(multistart_k1_seeds, "0,0.1,0.3", "Comma separated initial k1 values of the multi-start fit, relative to the squared half diagonal of the frame.");
+DEFINE_bool(check, false, "Check an existing calibration against new footage instead of calibrating: the straightness of the lines of the inputs is measured with the model of input_xml, or for a manifest with the calibrations of every camera and resolution in output_dir, as listed in its summary.yml.");
+DEFINE_string(input_xml, "", "Calibration to check.");
+DEFINE_int64(check_frames, 30, "Number of frames checked per camera.");
+DEFINE_double(check_max_residual, 1.0, "The check passes if 90% of the lines are straighter than this, in pixels.");
+DEFINE_bool(track_lines, false, "Follow the lines of a video into the next frames instead of extracting them on every frame, which is much faster. A line is used again only after it moved. Lines are extracted fully on keyframes and when tracking fails. Needs consecutive frames, so it can't be used with sample_frames.");
+DEFINE_int64(keyframe_interval, 30, "With track_lines, lines are extracted fully at least every this many frames. Zero means only when tracking fails.");
+DEFINE_int64(sample_frames, 0, "Use only this many random frames of every video, read in one forward pass. Zero means every frame.");
+DEFINE_int64(sample_seed, 42, "Seed of sample_frames, the videos of an input get consecutive seeds from it.");
+DEFINE_string(sample_mode, "uniform", "How sample_frames are picked: uniform, from all the frames, or stratified, one from each of sample_frames equal parts of the video.");
+DEFINE_bool(hdf5_identity_delta, false, "Store the chunked unwrapping matrix as the difference from the identity map. Compresses much better. The tools of this repo read it back, other hdf5 readers (CVHDFS::read, the python examples) see the difference and need to add the identity back.");
+
+
+// keeps the messages of the manifest mode workers whole
+static std::mutex output_mutex;
+
+
+// with a tracker the lines of video frames are tracked instead of extracted one by one
+void process_frame( cv::Mat frame, Lines &lines, LineTracker *tracker = nullptr )
 {
 
 	if( FLAGS_visual_confirm )
@@ -66,6 +109,10 @@ void process_frame( cv::Mat frame, Lines &lines )
 			}
 		}
 	}
+	else if( tracker!=nullptr )
+	{
+		tracker->track( frame, lines );
+	}
 	else
 	{
 		// no need for confirm, everything can go directly to the soup
@@ -76,47 +123,198 @@ void process_frame( cv::Mat frame, Lines &lines )
 	
 }
 
-int main(int argc, char** argv )
+LineTrackerOptions tracker_options()
 {
-	gflags::SetUsageMessage(USAGE_MESSAGE);
-	gflags::SetVersionString(VERSION);
+	LineTrackerOptions options;
+	options.keyframe_interval = FLAGS_keyframe_interval;
+	return options;
+}
 
-	gflags::ParseCommandLineFlags(&argc, &argv, true);
-	google::InitGoogleLogging(argv[0]);
+// the fit chosen by the flags
+bool fit_model( const Lines &lines, double undistorsion_factors[MODEL_SIZE], cv::Size frame_size, const ProgressContext *context )
+{
+	if( !FLAGS_multistart )
+	{
+		return fitUndistorsionModel( lines, undistorsion_factors, frame_size, context );
+	}
 
-	if( FLAGS_visual_confirm )
+	MultiStartOptions options;
+	options.center_steps = FLAGS_multistart_center_steps;
+	options.center_spread = FLAGS_multistart_center_spread;
+	options.k1_seeds.clear();
+	std::stringstream seeds( FLAGS_multistart_k1_seeds );
+	std::string seed;
+	while( std::getline( seeds, seed, ',' ) )
 	{
-		// display some description
-		std::cout << "Hit 'a' to accept the flashing line, or 'd' to deny the proposal." << std::endl;
+		options.k1_seeds.push_back( std::stod( seed ) );
 	}
+	return fitUndistorsionModelMultiStart( lines, undistorsion_factors, frame_size, options, context );
+}
 
-	// this is the container holding all the lines to be straightened
-	Lines lines;
 
-	// frame size
-	cv::Size frame_size;
+// in streaming mode the lines of every frame are handed to the calibrator right away
+void collect_lines( Lines &lines, cv::Size frame_size, std::unique_ptr<StreamingCalibrator> &streaming, const ProgressContext &progress )
+{
+	if( FLAGS_streaming_batch<=0 )
+	{
+		return;
+	}
+
+	if( !streaming )
+	{
+		StreamingCalibrationOptions options;
+		options.batch_size = FLAGS_streaming_batch;
+		options.reservoir_size = FLAGS_reservoir_size;
+		options.batch_callback = []( const StreamingBatchReport &report ) {
+			std::cout << "batch " << report.batch << ", " << report.lines_seen << " lines:";
+			const char *names[MODEL_SIZE] = { "cx", "cy", "k1", "k2" };
+			for( int i=0; i<MODEL_SIZE; i++ )
+			{
+				std::cout << " " << names[i] << " " << report.undistorsion_factors[i] << " (" << std::showpos << report.change[i] << std::noshowpos << ")";
+			}
+			std::cout << ", cost " << report.cost << std::endl;
+		};
+		streaming.reset( new StreamingCalibrator( frame_size, options, &progress ) );
+	}
+
+	streaming->add( lines );
+	lines.clear();
+}
+
+size_t line_count( const Lines &lines, const std::unique_ptr<StreamingCalibrator> &streaming )
+{
+	return streaming ? streaming->lines_seen() : lines.size();
+}
+
+
+// the sorted indices of samples frames of a video of frame_count frames, picked as sample_mode says
+std::vector<int64_t> sample_frame_indices( int64_t frame_count, int64_t samples, std::mt19937 &random )
+{
+	CHECK( FLAGS_sample_mode=="uniform" || FLAGS_sample_mode=="stratified" ) << "unknown sample_mode " << FLAGS_sample_mode;
+
+	std::vector<int64_t> indices;
+	if( samples>=frame_count )
+	{
+		indices.resize( frame_count );
+		std::iota( indices.begin(), indices.end(), 0 );
+	}
+	else if( FLAGS_sample_mode=="stratified" )
+	{
+		for( int64_t i=0; i<samples; i++ )
+		{
+			std::uniform_int_distribution<int64_t> pick( i * frame_count / samples, ( i + 1 ) * frame_count / samples - 1 );
+			indices.push_back( pick( random ) );
+		}
+	}
+	else
+	{
+		// Floyd's algorithm, distinct indices without a buffer of frame_count
+		std::set<int64_t> chosen;
+		for( int64_t j=frame_count-samples; j<frame_count; j++ )
+		{
+			std::uniform_int_distribution<int64_t> pick( 0, j );
+			if( !chosen.insert( pick( random ) ).second )
+			{
+				chosen.insert( j );
+			}
+		}
+		indices.assign( chosen.begin(), chosen.end() );
+	}
+	return indices;
+}
+
+// calls process for the sampled frames of a video, in one forward pass: the frames in between are only grabbed,
+// not converted or copied, which is much cheaper than seeking to every sample. false if process returned false
+bool process_sampled_frames( cv::VideoCapture &cap, const std::function<bool(const cv::Mat &frame)> &process, uint32_t seed )
+{
+	int64_t frame_count = (int64_t)cap.get( cv::CAP_PROP_FRAME_COUNT );
+	std::vector<int64_t> indices;
+	if( frame_count>0 )
+	{
+		std::mt19937 random( seed );
+		indices = sample_frame_indices( frame_count, FLAGS_sample_frames, random );
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock( output_mutex );
+		std::cout << "unknown frame count, the first " << FLAGS_sample_frames << " frames are used" << std::endl;
+		indices.resize( FLAGS_sample_frames );
+		std::iota( indices.begin(), indices.end(), 0 );
+	}
+
+	cv::Mat frame;
+	int64_t position = 0;
+	for( int64_t index : indices )
+	{
+		// the frame count of some containers is only an estimate, the video may end sooner
+		for( ; position<index; position++ )
+		{
+			if( !cap.grab() )
+			{
+				return true;
+			}
+		}
+		if( !cap.read( frame ) )
+		{
+			return true;
+		}
+		position++;
 
+		if( !process( frame ) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// calls process for every frame of the pictures and videos matched by the glob pattern, and cached for
+// every line cache among them, until one returns false. the fingerprints of the decoded inputs are added to sources.
+// started is called before the first frame of every picture and video
+void for_each_input(
+	const std::string &pattern,
+	const std::function<bool(const cv::Mat &frame)> &process,
+	const std::function<bool(const LineCache &cache)> &cached,
+	std::vector<std::string> *sources = nullptr,
+	const std::function<void()> &started = nullptr
+)
+{
 	// enumerate through paths matched by glob pattern
 	glob_t results;
-	CHECK( !glob(FLAGS_input.c_str(), 0, NULL, &results) ) << "For some reason can't glob the input pattern";
-	for (int pattern_idx = 0; pattern_idx < results.gl_pathc; pattern_idx++)
+	CHECK( !glob(pattern.c_str(), 0, NULL, &results) ) << "For some reason can't glob the input pattern " << pattern;
+	bool more = true;
+	for (size_t pattern_idx = 0; more && pattern_idx < results.gl_pathc; pattern_idx++)
 	{
-		// do we have enough lines already?
-		if ( FLAGS_max_line_count!=0 && lines.size()>FLAGS_max_line_count ) {
-			// we most definietly have
-			break;
-		}
 		std::string input_path( results.gl_pathv[pattern_idx] );
 
-		std::cout << input_path << std::endl;
+		{
+			std::lock_guard<std::mutex> lock( output_mutex );
+			std::cout << input_path << std::endl;
+		}
+
+		// lines extracted by an earlier run?
+		LineCache cache;
+		if( read_line_cache( input_path, cache ) )
+		{
+			more = cached( cache );
+			continue;
+		}
+
+		if( sources!=nullptr )
+		{
+			sources->push_back( source_fingerprint( input_path ) );
+		}
+		if( started )
+		{
+			started();
+		}
 
 		// try to load as image
 		cv::Mat frame = cv::imread(input_path);
 		if( frame.data!=NULL )
 		{
-			frame_size = frame.size(); // TODO we should check if they are all the same size
 			// managed to read
-			process_frame( frame, lines );
+			more = process( frame );
 			continue;
 		}
 		// couldn't read, maybe it's a video then?
@@ -126,32 +324,597 @@ int main(int argc, char** argv )
 		if( cap.open(input_path) )
 		{
 			// it's a video!
-			while(true)
+			if( FLAGS_sample_frames>0 )
+			{
+				more = process_sampled_frames( cap, process, (uint32_t)( FLAGS_sample_seed + pattern_idx ) );
+				continue;
+			}
+
+			while( more )
 			{
-				cv::Mat frame;
 				if( !cap.read( frame ) )
 				{
 					break;
 				}
-
-				frame_size = frame.size(); // TODO we should check if they are all the same size (there might be multiple videos, or videos and frames!)
-				process_frame( frame, lines );
+				more = process( frame );
 			}
 
 			continue;
 		}
 
 		// nop, not even a video. write out an error message then
+		std::lock_guard<std::mutex> lock( output_mutex );
 		std::cout << "couldn't read " << input_path << std::endl;
 	}
 
 	globfree( &results );
+}
+
+// writes the map and its mask in the format chosen by the hdf5 flags, with the valid spans of the map for frames of frame_size
+void write_unwrap( const std::string &path, const cv::Mat &unwrap_map, const cv::Mat &unwrap_mask, cv::Size frame_size )
+{
+	ValidSpans spans = valid_spans( unwrap_map, frame_size );
+
+	// map_io serializes the hdf5 calls, so the manifest workers can write concurrently
+	if( FLAGS_hdf5_band_rows>0 )
+	{
+		write_map_bands( path, "map", unwrap_map, FLAGS_hdf5_band_rows, FLAGS_hdf5_deflate, FLAGS_hdf5_identity_delta );
+		write_map_bands( path, "mask", unwrap_mask, FLAGS_hdf5_band_rows, FLAGS_hdf5_deflate, false );
+	}
+	else
+	{
+		write_dataset( path, "map", unwrap_map );
+		write_dataset( path, "mask", unwrap_mask );
+	}
+	write_valid_spans( path, spans );
+}
+
+
+// the lines of one camera at one resolution, calibrated together
+struct CalibrationGroup {
+	std::string camera;
+	std::string name; // camera, or camera_WxH if the camera has inputs of more resolutions
+	cv::Size frame_size;
+	int frame_count = 0;
+	Lines lines;
+
+	bool calibrated = false;
+	double undistorsion_factors[MODEL_SIZE];
+	double seconds = 0;
+};
+
+struct ManifestCamera {
+	std::string camera;
+	std::vector<std::string> patterns;
+	std::vector<CalibrationGroup> groups;
+};
+
+// reads the manifest: "camera_id glob_pattern" per line, a camera can have more lines. # starts a comment
+std::vector<ManifestCamera> read_manifest( const std::string &path )
+{
+	std::ifstream manifest( path );
+	CHECK( manifest.is_open() ) << "can't open " << path;
+
+	std::vector<ManifestCamera> cameras;
+	std::string line;
+	while( std::getline( manifest, line ) )
+	{
+		line = line.substr( 0, line.find( '#' ) );
+		std::stringstream fields( line );
+		std::string camera, pattern;
+		if( !( fields >> camera ) )
+		{
+			continue;
+		}
+		std::getline( fields >> std::ws, pattern );
+		pattern.erase( pattern.find_last_not_of( " \t\r" ) + 1 );
+		CHECK( pattern.size()>0 ) << "no input pattern for camera " << camera << " in " << path;
+
+		auto existing = std::find_if( cameras.begin(), cameras.end(), [&]( const ManifestCamera &c ) { return c.camera==camera; } );
+		if( existing==cameras.end() )
+		{
+			cameras.push_back( ManifestCamera() );
+			cameras.back().camera = camera;
+			existing = cameras.end() - 1;
+		}
+		existing->patterns.push_back( pattern );
+	}
+	return cameras;
+}
+
+// extracts the lines of whole cameras, grouped by resolution
+class ExtractCameraBody : public cv::ParallelLoopBody
+{
+public:
+	ExtractCameraBody( std::vector<ManifestCamera> &cameras ) : cameras(cameras) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int i=range.start; i<range.end; i++ )
+		{
+			ManifestCamera &camera = cameras[i];
+			size_t line_count = 0;
+			std::unique_ptr<LineTracker> tracker( FLAGS_track_lines ? new LineTracker( tracker_options() ) : nullptr );
+
+			// the group of a resolution, created at its first frame
+			auto group_of = [&]( cv::Size frame_size ) -> std::vector<CalibrationGroup>::iterator {
+				auto group = std::find_if( camera.groups.begin(), camera.groups.end(), [&]( const CalibrationGroup &g ) { return g.frame_size==frame_size; } );
+				if( group==camera.groups.end() )
+				{
+					camera.groups.push_back( CalibrationGroup() );
+					camera.groups.back().camera = camera.camera;
+					camera.groups.back().frame_size = frame_size;
+					group = camera.groups.end() - 1;
+				}
+				return group;
+			};
+
+			for( const std::string &pattern : camera.patterns )
+			{
+				for_each_input( pattern, [&]( const cv::Mat &frame ) -> bool {
+					auto group = group_of( frame.size() );
+					size_t before = group->lines.size();
+					process_frame( frame, group->lines, tracker.get() );
+					group->frame_count++;
+					line_count += group->lines.size() - before;
+					return FLAGS_max_line_count==0 || line_count<=(size_t)FLAGS_max_line_count;
+				}, [&]( const LineCache &cache ) -> bool {
+					auto group = group_of( cache.frame_size );
+					group->lines.insert( group->lines.end(), cache.lines.begin(), cache.lines.end() );
+					line_count += cache.lines.size();
+					return FLAGS_max_line_count==0 || line_count<=(size_t)FLAGS_max_line_count;
+				}, nullptr, [&]() {
+					if( tracker )
+					{
+						tracker->reset();
+					}
+				});
+			}
+
+			for( CalibrationGroup &group : camera.groups )
+			{
+				std::stringstream name;
+				name << camera.camera;
+				if( camera.groups.size()>1 )
+				{
+					name << "_" << group.frame_size.width << "x" << group.frame_size.height;
+				}
+				group.name = name.str();
+			}
+
+			std::lock_guard<std::mutex> lock( output_mutex );
+			std::cout << camera.camera << ": " << line_count << " lines in " << camera.groups.size() << " resolution(s)";
+			if( tracker )
+			{
+				std::cout << ", " << tracker->keyframes() << " keyframes of " << tracker->frames() << " frames";
+			}
+			std::cout << std::endl;
+		}
+	}
+
+private:
+	std::vector<ManifestCamera> &cameras;
+};
+
+// fits, unwraps and writes the outputs of groups
+class CalibrateGroupBody : public cv::ParallelLoopBody
+{
+public:
+	CalibrateGroupBody( std::vector<CalibrationGroup*> &groups ) : groups(groups) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int i=range.start; i<range.end; i++ )
+		{
+			CalibrationGroup &group = *groups[i];
+			if( group.lines.empty() )
+			{
+				std::lock_guard<std::mutex> lock( output_mutex );
+				std::cout << group.name << ": no lines, not calibrated" << std::endl;
+				continue;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			group.calibrated = fit_model( group.lines, group.undistorsion_factors, group.frame_size, nullptr );
+			if( !group.calibrated )
+			{
+				std::lock_guard<std::mutex> lock( output_mutex );
+				std::cout << group.name << ": the fit failed, not calibrated" << std::endl;
+				continue;
+			}
+
+			std::string path = FLAGS_output_dir + "/" + group.name;
+			write_calibration( path + ".xml", group.undistorsion_factors, group.frame_size );
+
+			cv::Mat unwrap_map, unwrap_mask;
+			prepare_unwrap( group.undistorsion_factors, group.frame_size, FLAGS_unwrap_factor, unwrap_map, unwrap_mask );
+			write_unwrap( path + ".hdf5", unwrap_map, unwrap_mask, group.frame_size );
+			group.seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+			std::lock_guard<std::mutex> lock( output_mutex );
+			std::cout << group.name << ": calibrated on " << group.lines.size() << " lines in " << group.seconds << "s"
+				<< ", cx " << group.undistorsion_factors[0] << " cy " << group.undistorsion_factors[1]
+				<< " k1 " << group.undistorsion_factors[2] << " k2 " << group.undistorsion_factors[3] << std::endl;
+		}
+	}
+
+private:
+	std::vector<CalibrationGroup*> &groups;
+};
+
+void calibrate_manifest()
+{
+	CHECK( !FLAGS_visual_confirm ) << "visual_confirm is not supported with a manifest";
+	CHECK( FLAGS_streaming_batch<=0 ) << "streaming_batch is not supported with a manifest";
+	CHECK( FLAGS_output_lines.size()==0 ) << "output_lines is not supported with a manifest";
+	CHECK( FLAGS_output_dir.size()>0 ) << "output_dir is needed with a manifest";
+	if( mkdir( FLAGS_output_dir.c_str(), 0777 )!=0 )
+	{
+		CHECK_EQ( errno, EEXIST ) << "can't create " << FLAGS_output_dir;
+	}
+
+	std::vector<ManifestCamera> cameras = read_manifest( FLAGS_manifest );
+	std::cout << cameras.size() << " cameras in " << FLAGS_manifest << std::endl;
+
+	// extraction, then fitting, both spread over the cameras on opencv's thread pool
+	cv::parallel_for_( cv::Range( 0, cameras.size() ), ExtractCameraBody( cameras ), cameras.size() );
+
+	std::vector<CalibrationGroup*> groups;
+	for( ManifestCamera &camera : cameras )
+	{
+		for( CalibrationGroup &group : camera.groups )
+		{
+			groups.push_back( &group );
+		}
+	}
+	std::cout << "calibrating " << groups.size() << " groups, might take a few minutes." << std::endl;
+	cv::parallel_for_( cv::Range( 0, groups.size() ), CalibrateGroupBody( groups ), groups.size() );
+
+	cv::FileStorage summary( FLAGS_output_dir + "/summary.yml", cv::FileStorage::WRITE );
+	summary << "groups" << "[";
+	for( const CalibrationGroup *group : groups )
+	{
+		summary << "{";
+		summary << "camera" << group->camera;
+		summary << "name" << group->name;
+		summary << "width" << group->frame_size.width;
+		summary << "height" << group->frame_size.height;
+		summary << "frames" << group->frame_count;
+		summary << "lines" << (int)group->lines.size();
+		summary << "calibrated" << group->calibrated;
+		if( group->calibrated )
+		{
+			summary << "cx" << group->undistorsion_factors[0];
+			summary << "cy" << group->undistorsion_factors[1];
+			summary << "k1" << group->undistorsion_factors[2];
+			summary << "k2" << group->undistorsion_factors[3];
+			summary << "seconds" << group->seconds;
+			summary << "xml" << group->name + ".xml";
+			summary << "hdf5" << group->name + ".hdf5";
+		}
+		summary << "}";
+	}
+	summary << "]";
+	std::cout << "summary written to " << FLAGS_output_dir << "/summary.yml" << std::endl;
+}
+
+
+// extracts the lines of a batch of frames in parallel
+class ExtractFramesBody : public cv::ParallelLoopBody
+{
+public:
+	ExtractFramesBody( const std::vector<cv::Mat> &frames, std::vector<Lines> &lines ) : frames(frames), lines(lines) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int i=range.start; i<range.end; i++ )
+		{
+			extract_lines( frames[i], lines[i] );
+		}
+	}
+
+private:
+	const std::vector<cv::Mat> &frames;
+	std::vector<Lines> &lines;
+};
+
+struct HealthCheck {
+	std::string camera;
+	cv::Size frame_size;
+	double undistorsion_factors[MODEL_SIZE];
+	int frame_count = 0;
+	int skipped_frames = 0;
+
+	std::vector<double> residuals;          // of the lines, under the model
+	std::vector<double> baseline_residuals; // of the lines, without undistortion
+	bool passed = false;
+};
+
+double percentile( std::vector<double> values, double fraction )
+{
+	if( values.empty() )
+	{
+		return 0.0;
+	}
+	size_t idx = std::min( values.size()-1, (size_t)( fraction * values.size() ) );
+	std::nth_element( values.begin(), values.begin() + idx, values.end() );
+	return values[idx];
+}
+
+// measures the straightness of the lines of up to check_frames frames under the stored model
+void check_calibration( const std::vector<std::string> &patterns, HealthCheck &check )
+{
+	std::vector<cv::Mat> batch;
+	Lines lines;
+
+	auto extract_batch = [&]() {
+		std::vector<Lines> batch_lines( batch.size() );
+		cv::parallel_for_( cv::Range( 0, batch.size() ), ExtractFramesBody( batch, batch_lines ) );
+		for( const Lines &frame_lines : batch_lines )
+		{
+			lines.insert( lines.end(), frame_lines.begin(), frame_lines.end() );
+		}
+		batch.clear();
+	};
+
+	for( const std::string &pattern : patterns )
+	{
+		if( check.frame_count>=FLAGS_check_frames )
+		{
+			break;
+		}
+		for_each_input( pattern, [&]( const cv::Mat &frame ) -> bool {
+			if( frame.size()!=check.frame_size )
+			{
+				check.skipped_frames++;
+				return true;
+			}
+			// the frame buffer of a video is reused for the next frame
+			batch.push_back( frame.clone() );
+			check.frame_count++;
+			if( (int)batch.size()>=cv::getNumThreads() )
+			{
+				extract_batch();
+			}
+			return check.frame_count<FLAGS_check_frames;
+		}, [&]( const LineCache &cache ) -> bool {
+			if( cache.frame_size!=check.frame_size )
+			{
+				check.skipped_frames++;
+				return true;
+			}
+			lines.insert( lines.end(), cache.lines.begin(), cache.lines.end() );
+			return true;
+		});
+	}
+	extract_batch();
+
+	double baseline[MODEL_SIZE] = { check.undistorsion_factors[0], check.undistorsion_factors[1], 0.0, 0.0 };
+	for( const Line &line : lines )
+	{
+		check.residuals.push_back( line_straightness( line, check.undistorsion_factors ) );
+		check.baseline_residuals.push_back( line_straightness( line, baseline ) );
+	}
+
+	check.passed = !check.residuals.empty() && percentile( check.residuals, 0.9 )<=FLAGS_check_max_residual;
+}
+
+void report_check( const HealthCheck &check )
+{
+	std::lock_guard<std::mutex> lock( output_mutex );
+	std::cout << check.camera << ": " << check.frame_count << " frames";
+	if( check.skipped_frames>0 )
+	{
+		std::cout << " (" << check.skipped_frames << " of an other resolution skipped)";
+	}
+	std::cout << ", " << check.residuals.size() << " lines" << std::endl;
+
+	if( !check.residuals.empty() )
+	{
+		double mean = std::accumulate( check.residuals.begin(), check.residuals.end(), 0.0 ) / check.residuals.size();
+		std::cout << "  straightness px: mean " << mean
+			<< ", median " << percentile( check.residuals, 0.5 )
+			<< ", p90 " << percentile( check.residuals, 0.9 )
+			<< ", max " << *std::max_element( check.residuals.begin(), check.residuals.end() ) << std::endl;
+		std::cout << "  without undistortion: median " << percentile( check.baseline_residuals, 0.5 )
+			<< ", p90 " << percentile( check.baseline_residuals, 0.9 ) << std::endl;
+	}
+	std::cout << "  " << ( check.passed ? "PASS" : "FAIL" ) << std::endl;
+}
+
+// a calibration in output_dir of a camera of the manifest
+struct CheckTarget {
+	const ManifestCamera *camera;
+	std::string name; // the group name of the manifest mode, camera or camera_WxH
+	std::string xml;
+};
+
+// a camera has a calibration per resolution, as listed in the summary.yml of the manifest mode.
+// cameras missing from it, or all of them if there is no summary, are looked for as <camera>.xml
+std::vector<CheckTarget> check_targets( const std::vector<ManifestCamera> &cameras )
+{
+	std::vector<CheckTarget> targets;
+	cv::FileStorage summary( FLAGS_output_dir + "/summary.yml", cv::FileStorage::READ );
+	for( const ManifestCamera &camera : cameras )
+	{
+		size_t found = targets.size();
+		if( summary.isOpened() )
+		{
+			cv::FileNode groups = summary["groups"];
+			for( cv::FileNodeIterator group=groups.begin(); group!=groups.end(); ++group )
+			{
+				if( (std::string)(*group)["camera"]!=camera.camera || (int)(*group)["calibrated"]==0 )
+				{
+					continue;
+				}
+				targets.push_back( CheckTarget{ &camera, (std::string)(*group)["name"], FLAGS_output_dir + "/" + (std::string)(*group)["xml"] } );
+			}
+		}
+		if( targets.size()==found )
+		{
+			targets.push_back( CheckTarget{ &camera, camera.camera, FLAGS_output_dir + "/" + camera.camera + ".xml" } );
+		}
+	}
+	return targets;
+}
+
+// checks the cameras of a manifest against their calibrations in output_dir, every resolution against its own
+class CheckCameraBody : public cv::ParallelLoopBody
+{
+public:
+	CheckCameraBody( const std::vector<CheckTarget> &targets, std::vector<HealthCheck> &checks ) : targets(targets), checks(checks) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int i=range.start; i<range.end; i++ )
+		{
+			HealthCheck &check = checks[i];
+			check.camera = targets[i].name;
+			if( !read_calibration( targets[i].xml, check.undistorsion_factors, check.frame_size ) )
+			{
+				std::lock_guard<std::mutex> lock( output_mutex );
+				std::cout << check.camera << ": can't read " << targets[i].xml << std::endl;
+				continue;
+			}
+			// frames of the other resolutions of the camera are skipped
+			check_calibration( targets[i].camera->patterns, check );
+			report_check( check );
+		}
+	}
+
+private:
+	const std::vector<CheckTarget> &targets;
+	std::vector<HealthCheck> &checks;
+};
+
+// returns the number of failed checks
+int check()
+{
+	std::vector<HealthCheck> checks;
+	if( FLAGS_manifest.size()>0 )
+	{
+		std::vector<ManifestCamera> cameras = read_manifest( FLAGS_manifest );
+		std::vector<CheckTarget> targets = check_targets( cameras );
+		checks.resize( targets.size() );
+		cv::parallel_for_( cv::Range( 0, targets.size() ), CheckCameraBody( targets, checks ), targets.size() );
+	}
+	else
+	{
+		checks.resize( 1 );
+		HealthCheck &check = checks[0];
+		check.camera = FLAGS_input_xml;
+		CHECK( read_calibration( FLAGS_input_xml, check.undistorsion_factors, check.frame_size ) ) << "can't read " << FLAGS_input_xml;
+		check_calibration( std::vector<std::string>( 1, FLAGS_input ), check );
+		report_check( check );
+	}
+
+	return std::count_if( checks.begin(), checks.end(), []( const HealthCheck &check ) { return !check.passed; } );
+}
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	// the tracker follows lines only a few pixels from frame to frame, samples are far apart
+	CHECK( !( FLAGS_track_lines && FLAGS_sample_frames>0 ) ) << "track_lines needs consecutive frames, it can't be used with sample_frames";
+	// streaming doesn't keep the lines, there would be nothing to write
+	CHECK( !( FLAGS_output_lines.size()>0 && FLAGS_streaming_batch>0 ) ) << "output_lines can't be used with streaming_batch, the lines are not kept";
+
+	if( FLAGS_check )
+	{
+		return check()>0 ? 1 : 0;
+	}
+
+	if( FLAGS_manifest.size()>0 )
+	{
+		calibrate_manifest();
+		return 0;
+	}
+
+	if( FLAGS_visual_confirm )
+	{
+		// display some description
+		std::cout << "Hit 'a' to accept the flashing line, or 'd' to deny the proposal." << std::endl;
+	}
+
+	// this is the container holding all the lines to be straightened, or the lines of the current frame in streaming mode
+	LineCache collected;
+	Lines &lines = collected.lines;
+	std::unique_ptr<StreamingCalibrator> streaming;
+	ProgressContext progress = console_progress( FLAGS_details_calibration );
+
+	// frame size
+	cv::Size &frame_size = collected.frame_size;
+
+	std::unique_ptr<LineTracker> tracker;
+	if( FLAGS_track_lines )
+	{
+		CHECK( !FLAGS_visual_confirm ) << "track_lines can't be used with visual_confirm";
+		tracker.reset( new LineTracker( tracker_options() ) );
+	}
+
+	for_each_input( FLAGS_input, [&]( const cv::Mat &frame ) -> bool {
+		// the model is only valid for one resolution
+		CHECK( frame_size.area()==0 || frame_size==frame.size() ) << "inputs of different resolutions (" << frame_size << " and " << frame.size()
+			<< "), calibrate them separately, or with a manifest";
+		frame_size = frame.size();
+
+		process_frame( frame, lines, tracker.get() );
+		collect_lines( lines, frame_size, streaming, progress );
+
+		// do we have enough lines already?
+		return FLAGS_max_line_count==0 || line_count( lines, streaming )<=(size_t)FLAGS_max_line_count;
+	}, [&]( const LineCache &cache ) -> bool {
+		CHECK( frame_size.area()==0 || frame_size==cache.frame_size ) << "inputs of different resolutions (" << frame_size << " and " << cache.frame_size
+			<< "), calibrate them separately, or with a manifest";
+		frame_size = cache.frame_size;
+
+		if( !merge_line_cache( collected, cache ) )
+		{
+			std::cout << "skipped, the lines of its sources are loaded already" << std::endl;
+			return true;
+		}
+		std::cout << cache.lines.size() << " cached lines" << std::endl;
+		collect_lines( lines, frame_size, streaming, progress );
+
+		return FLAGS_max_line_count==0 || line_count( lines, streaming )<=(size_t)FLAGS_max_line_count;
+	}, &collected.sources, [&]() {
+		if( tracker )
+		{
+			tracker->reset();
+		}
+	});
+
+	if( tracker )
+	{
+		std::cout << "lines extracted on " << tracker->keyframes() << " keyframes, tracked on the other " << tracker->frames() - tracker->keyframes() << " frames" << std::endl;
+	}
+
+	if( FLAGS_output_lines.size()>0 )
+	{
+		write_line_cache( FLAGS_output_lines, collected );
+		std::cout << lines.size() << " lines written to " << FLAGS_output_lines << std::endl;
+	}
 
 
 	// okay we have our lines, we should fit the model now
 	std::cout << "calibrating, might take a few minutes." << std::endl;
+
 	double  undistorsion_factors[MODEL_SIZE];
-	fitUndistorsionModel( lines, undistorsion_factors, frame_size );
+	if( streaming )
+	{
+		std::cout << "refining on " << std::min( (size_t)FLAGS_reservoir_size, streaming->lines_seen() ) << " of " << streaming->lines_seen() << " lines" << std::endl;
+		streaming->finish( undistorsion_factors );
+	}
+	else
+	{
+		fit_model( lines, undistorsion_factors, frame_size, &progress );
+	}
 
 	std::cout << "calibrated." << std::endl;
 	std::cout << "cx: " << undistorsion_factors[0] << std::endl;
@@ -167,11 +930,10 @@ int main(int argc, char** argv )
 	if( FLAGS_output_hdf5.size()>0 )
 	{
 		std::cout << "unwrapping, might take a few more minutes" << std::endl;
-		prepare_unwrap( undistorsion_factors, frame_size, FLAGS_unwrap_factor, unwrap_map, unwrap_mask );
+		prepare_unwrap( undistorsion_factors, frame_size, FLAGS_unwrap_factor, unwrap_map, unwrap_mask, &progress );
 		std::cout << "unwrapping done" << std::endl;
 
-		CVHDFS::write( FLAGS_output_hdf5, "map", unwrap_map);
-		CVHDFS::write( FLAGS_output_hdf5, "mask", unwrap_mask);
+		write_unwrap( FLAGS_output_hdf5, unwrap_map, unwrap_mask, frame_size );
 	}
 
 	// save the parameters into xml or yaml if requested
@@ -179,15 +941,7 @@ int main(int argc, char** argv )
 	if( FLAGS_output_xml.size()>0 )
 	{
 		// FLAGS_output_xml is not empty save then
-		cv::FileStorage fs(FLAGS_output_xml, cv::FileStorage::WRITE);
-		fs << "cx" << undistorsion_factors[0];
-		fs << "cy" << undistorsion_factors[1];
-		fs << "k1" << undistorsion_factors[2];
-		fs << "k2" << undistorsion_factors[3];
-
-		fs << "width" << frame_size.width;
-		fs << "height" << frame_size.height;
-		fs.release();
+		write_calibration( FLAGS_output_xml, undistorsion_factors, frame_size );
 	}
 
 
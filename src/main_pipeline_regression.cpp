@@ -0,0 +1,150 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "lines.h"
+#include "undistort.h"
+#include "synthetic.h"
+#include "map_verify.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "runs extract_lines, fitUndistorsionModel and prepare_unwrap on synthetic stripe frames of known model, reports the time of every stage and the errors. exits with failure if an error is over its limit."
+
+DEFINE_int64(width, 1280, "Frame width.");
+DEFINE_int64(height, 720, "Frame height.");
+DEFINE_double(cx, 660.0, "True distortion center x.");
+DEFINE_double(cy, 350.0, "True distortion center y.");
+DEFINE_double(k1, 1e-7, "True k1.");
+DEFINE_double(k2, 1e-14, "True k2.");
+DEFINE_int64(frames, 16, "Number of synthetic frames.");
+DEFINE_double(period, 80.0, "Stripe period in undistorted pixels.");
+DEFINE_double(blur, 0.8, "Sigma of the gaussian blur in pixels.");
+DEFINE_double(noise, 2.0, "Sigma of the gaussian noise in gray levels.");
+DEFINE_double(vignetting, 0.3, "Brightness loss in the frame corners, 0 to 1.");
+DEFINE_int64(seed, 1, "Seed of the noise and the stripe shifts.");
+DEFINE_double(unwrap_factor, 1.0, "Unwrap factor of the map.");
+DEFINE_bool(solver_inverse, false, "Generate the map with the ceres inverse instead of newton iterations. Much slower.");
+
+DEFINE_double(max_model_error, 1.0, "Limit of the largest difference of the true and the fitted undistortion over the frame, in pixels.");
+DEFINE_double(max_roundtrip_error, 0.05, "Limit of the largest map round trip error, in pixels.");
+
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since( Clock::time_point start )
+{
+	return std::chrono::duration<double>( Clock::now() - start ).count();
+}
+
+// the largest distance of the undistortions of the two models, over a grid on the frame
+double model_difference( const double a[MODEL_SIZE], const double b[MODEL_SIZE], cv::Size frame_size )
+{
+	const int grid_step = 8;
+	double largest = 0.0;
+	for( int y=0; y<=frame_size.height; y+=grid_step )
+	{
+		for( int x=0; x<=frame_size.width; x+=grid_step )
+		{
+			cv::Point2d point( x, y );
+			largest = std::max( largest, cv::norm( undistort( a, point ) - undistort( b, point ) ) );
+		}
+	}
+	return largest;
+}
+
+void report_stage( const std::string &stage, double seconds )
+{
+	std::cout << std::left << std::setw( 12 ) << stage << std::right << std::fixed << std::setprecision( 3 ) << std::setw( 10 ) << seconds << "s" << std::endl;
+}
+
+bool gate( const std::string &name, double value, double limit )
+{
+	bool passed = value<=limit;
+	std::cout << ( passed ? "PASS " : "FAIL " ) << name << " " << std::setprecision( 4 ) << value << " (limit " << limit << ")" << std::endl;
+	return passed;
+}
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	StripeTarget base;
+	base.frame_size = cv::Size( FLAGS_width, FLAGS_height );
+	base.undistorsion_factors[0] = FLAGS_cx;
+	base.undistorsion_factors[1] = FLAGS_cy;
+	base.undistorsion_factors[2] = FLAGS_k1;
+	base.undistorsion_factors[3] = FLAGS_k2;
+	base.period = FLAGS_period;
+	base.blur = FLAGS_blur;
+	base.noise = FLAGS_noise;
+	base.vignetting = FLAGS_vignetting;
+	const double *truth = base.undistorsion_factors;
+
+	cv::RNG rng( FLAGS_seed );
+
+	Clock::time_point start = Clock::now();
+	std::vector<cv::Mat> frames( FLAGS_frames );
+	for( int i=0; i<FLAGS_frames; i++ )
+	{
+		render_stripes( stripe_sequence_frame( base, i, FLAGS_frames, rng ), frames[i], rng );
+	}
+	double render_seconds = seconds_since( start );
+
+	start = Clock::now();
+	Lines lines;
+	for( const cv::Mat &frame : frames )
+	{
+		extract_lines( frame.clone(), lines );
+	}
+	double extract_seconds = seconds_since( start );
+	CHECK( !lines.empty() ) << "no lines extracted from the synthetic frames";
+
+	start = Clock::now();
+	double fitted[MODEL_SIZE];
+	fitUndistorsionModel( lines, fitted, base.frame_size );
+	double fit_seconds = seconds_since( start );
+
+	start = Clock::now();
+	cv::Mat unwrap_map, unwrap_mask;
+	prepare_unwrap( fitted, base.frame_size, FLAGS_unwrap_factor, unwrap_map, unwrap_mask, nullptr,
+		FLAGS_solver_inverse ? InverseMethod::SOLVER : InverseMethod::NEWTON );
+	double unwrap_seconds = seconds_since( start );
+
+	std::cout << FLAGS_frames << " frames of " << base.frame_size << ", " << lines.size() << " lines, map " << unwrap_map.size() << std::endl;
+	report_stage( "render", render_seconds );
+	report_stage( "extract", extract_seconds );
+	report_stage( "fit", fit_seconds );
+	report_stage( "unwrap", unwrap_seconds );
+
+	const char *names[MODEL_SIZE] = { "cx", "cy", "k1", "k2" };
+	for( int i=0; i<MODEL_SIZE; i++ )
+	{
+		std::cout << names[i] << " true " << std::scientific << std::setprecision( 6 ) << truth[i]
+			<< " fitted " << fitted[i] << " error " << fitted[i] - truth[i] << std::endl;
+	}
+
+	UnwrapGrid grid = unwrap_grid( fitted, base.frame_size, FLAGS_unwrap_factor );
+	MapVerifyReport verified = verify_map( fitted, base.frame_size, grid, unwrap_map, unwrap_mask );
+	std::cout << std::fixed << "map round trip error: max " << std::setprecision( 4 ) << verified.max_error << "px, mean " << verified.mean_error << "px" << std::endl;
+
+	bool passed = true;
+	passed &= gate( "model error px", model_difference( truth, fitted, base.frame_size ), FLAGS_max_model_error );
+	passed &= gate( "round trip error px", verified.max_error, FLAGS_max_roundtrip_error );
+	passed &= gate( "mask inconsistencies", verified.mask_missing + verified.mask_extra, 0 );
+
+	return passed ? 0 : 1;
+}
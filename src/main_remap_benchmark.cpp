@@ -0,0 +1,94 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "map_io.h"
+
+#include "lanczos_remap.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "times the Lanczos remap of a picture with an unwrap matrix, opencv's remap against the precomputed LanczosRemapper."
+
+DEFINE_string(input, "", "Picture to remap.");
+DEFINE_string(input_hdf5, "", "Path of unwrapping matrix, generated by lens_undistort.");
+DEFINE_int64(iterations, 50, "Number of timed remaps of each method.");
+DEFINE_bool(gray, false, "Remap the picture converted to gray, instead of 3 channels.");
+
+
+// mean milliseconds of one remap, after a warmup run
+double time_remap( const std::function<void()> &remap )
+{
+	remap();
+	auto start = std::chrono::steady_clock::now();
+	for( int64_t i=0; i<FLAGS_iterations; i++ )
+	{
+		remap();
+	}
+	return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count() / FLAGS_iterations;
+}
+
+void report( const std::string &name, double milliseconds, double reference_milliseconds, const cv::Mat &result, const cv::Mat &reference )
+{
+	cv::Mat difference;
+	cv::absdiff( result, reference, difference );
+	double max_difference;
+	cv::minMaxLoc( difference.reshape( 1 ), NULL, &max_difference );
+	cv::Scalar mean_difference = cv::mean( difference.reshape( 1 ) );
+
+	std::cout << std::left << std::setw( 24 ) << name << std::right << std::fixed << std::setprecision( 2 )
+		<< std::setw( 9 ) << milliseconds << "ms  "
+		<< std::setw( 6 ) << reference_milliseconds / milliseconds << "x  "
+		<< "difference max " << max_difference << ", mean " << std::setprecision( 4 ) << mean_difference[0] << std::endl;
+}
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	cv::Mat frame = cv::imread( FLAGS_input, FLAGS_gray ? cv::IMREAD_GRAYSCALE : cv::IMREAD_COLOR );
+	CHECK( !frame.empty() ) << "can't read " << FLAGS_input;
+
+	cv::Mat unwrap_map;
+	read_map( FLAGS_input_hdf5, "map", unwrap_map );
+	CHECK_EQ( unwrap_map.type(), CV_32FC2 ) << "unwrap map should be CV_32FC2";
+
+	std::cout << frame.size() << " x" << frame.channels() << " to " << unwrap_map.size()
+		<< ", " << FLAGS_iterations << " iterations, " << cv::getNumThreads() << " threads" << std::endl;
+
+	cv::Mat reference;
+	double reference_milliseconds = time_remap( [&]() {
+		cv::remap( frame, reference, unwrap_map, cv::Mat(), cv::INTER_LANCZOS4 );
+	});
+	report( "cv::remap float map", reference_milliseconds, reference_milliseconds, reference, reference );
+
+	cv::Mat map1, map2, fixed_point;
+	cv::convertMaps( unwrap_map, cv::Mat(), map1, map2, CV_16SC2 );
+	double fixed_point_milliseconds = time_remap( [&]() {
+		cv::remap( frame, fixed_point, map1, map2, cv::INTER_LANCZOS4 );
+	});
+	report( "cv::remap fixed point", fixed_point_milliseconds, reference_milliseconds, fixed_point, reference );
+
+	auto start = std::chrono::steady_clock::now();
+	LanczosRemapper remapper( unwrap_map );
+	double setup_milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+	cv::Mat table;
+	double table_milliseconds = time_remap( [&]() {
+		remapper.execute( frame, table );
+	});
+	report( "LanczosRemapper", table_milliseconds, reference_milliseconds, table, reference );
+	std::cout << "LanczosRemapper table built in " << std::setprecision( 2 ) << setup_milliseconds << "ms" << std::endl;
+}
@@ -0,0 +1,156 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "remap_service.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "load generator for remap_server. submits frames through shared memory and reports the latency percentiles."
+
+DEFINE_string(socket, "/tmp/remap_server.sock", "Path of the remap_server control socket.");
+DEFINE_string(camera, "", "Camera id to remap with.");
+DEFINE_string(input, "", "Picture submitted over and over again.");
+DEFINE_int64(frames, 1000, "Number of frames to submit.");
+DEFINE_int64(inflight, 4, "Number of frames in flight at once.");
+DEFINE_string(output, "", "If set, the last remapped frame is written here, to eyeball the result.");
+
+
+typedef std::chrono::steady_clock Clock;
+
+RemapMessage receive( int socket )
+{
+	RemapMessage message;
+	ssize_t received = recv( socket, &message, sizeof(message), 0 );
+	CHECK_EQ( received, (ssize_t)sizeof(message) ) << "lost connection to the server";
+	CHECK_NE( message.type, (uint32_t)REMAP_ERROR ) << "server error: " << std::string( message.camera, strnlen( message.camera, REMAP_NAME_SIZE ) );
+	return message;
+}
+
+void send_message( int socket, const RemapMessage &message )
+{
+	CHECK_EQ( send( socket, &message, sizeof(message), MSG_NOSIGNAL ), (ssize_t)sizeof(message) ) << "lost connection to the server";
+}
+
+double percentile( const std::vector<double> &sorted, double fraction )
+{
+	size_t idx = std::min( sorted.size()-1, (size_t)( fraction * sorted.size() ) );
+	return sorted[idx];
+}
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	cv::Mat frame = cv::imread( FLAGS_input );
+	CHECK( !frame.empty() ) << "can't read " << FLAGS_input;
+	CHECK( frame.isContinuous() );
+
+	int connection = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+	CHECK_GE( connection, 0 ) << "can't create socket";
+	struct sockaddr_un address;
+	memset( &address, 0, sizeof(address) );
+	address.sun_family = AF_UNIX;
+	strncpy( address.sun_path, FLAGS_socket.c_str(), sizeof(address.sun_path)-1 );
+	CHECK_EQ( connect( connection, (struct sockaddr*)&address, sizeof(address) ), 0 ) << "can't connect to " << FLAGS_socket;
+
+	RemapMessage attach;
+	memset( &attach, 0, sizeof(attach) );
+	attach.type = REMAP_ATTACH;
+	strncpy( attach.camera, FLAGS_camera.c_str(), REMAP_NAME_SIZE-1 );
+	attach.slot_count = FLAGS_inflight;
+	attach.input_width = frame.cols;
+	attach.input_height = frame.rows;
+	attach.channels = frame.channels();
+	send_message( connection, attach );
+
+	RemapMessage attached = receive( connection );
+	CHECK_EQ( attached.type, (uint32_t)REMAP_ATTACHED );
+
+	size_t ring_bytes = attached.slot_bytes * attached.slot_count;
+	int fd = shm_open( attached.shm_name, O_RDWR, 0600 );
+	CHECK_GE( fd, 0 ) << "can't open shared memory " << attached.shm_name;
+	void *mapped = mmap( NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	CHECK( mapped!=MAP_FAILED ) << "can't map shared memory";
+	uint8_t *ring = (uint8_t*)mapped;
+
+	std::cout << "attached to " << FLAGS_camera << ", output " << attached.output_width << "x" << attached.output_height << std::endl;
+
+	std::vector<Clock::time_point> submitted( attached.slot_count );
+	std::vector<double> latencies;
+	latencies.reserve( FLAGS_frames );
+
+	auto submit = [&]( uint32_t slot ) {
+		memcpy( ring + slot * attached.slot_bytes, frame.data, remap_input_bytes( attached ) );
+		RemapMessage message;
+		memset( &message, 0, sizeof(message) );
+		message.type = REMAP_SUBMIT;
+		message.slot = slot;
+		submitted[slot] = Clock::now();
+		send_message( connection, message );
+	};
+
+	Clock::time_point start = Clock::now();
+	int64_t sent = 0;
+	for( uint32_t slot=0; slot<attached.slot_count && sent<FLAGS_frames; slot++, sent++ )
+	{
+		submit( slot );
+	}
+
+	uint32_t last_slot = 0;
+	while( (int64_t)latencies.size()<sent )
+	{
+		RemapMessage done = receive( connection );
+		CHECK_EQ( done.type, (uint32_t)REMAP_DONE );
+		CHECK_LT( done.slot, attached.slot_count );
+
+		latencies.push_back( std::chrono::duration<double, std::milli>( Clock::now() - submitted[done.slot] ).count() );
+		last_slot = done.slot;
+
+		if( sent<FLAGS_frames )
+		{
+			submit( done.slot );
+			sent++;
+		}
+	}
+	double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+
+	if( FLAGS_output.size()>0 )
+	{
+		cv::Mat output( attached.output_height, attached.output_width, frame.type(),
+			ring + last_slot * attached.slot_bytes + remap_input_bytes( attached ) );
+		cv::imwrite( FLAGS_output, output );
+	}
+
+	std::sort( latencies.begin(), latencies.end() );
+	std::cout << latencies.size() << " frames in " << std::fixed << std::setprecision(2) << seconds << "s, "
+		<< (latencies.size() / seconds) << " fps" << std::endl;
+	std::cout << "latency ms: p50 " << percentile( latencies, 0.5 )
+		<< ", p90 " << percentile( latencies, 0.9 )
+		<< ", p99 " << percentile( latencies, 0.99 )
+		<< ", max " << latencies.back() << std::endl;
+
+	munmap( mapped, ring_bytes );
+	close( connection );
+}
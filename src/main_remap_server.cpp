@@ -0,0 +1,446 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "map_io.h"
+
+#include "undistort.h"
+#include "unwrap_plan.h"
+#include "remap_service.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "keeps the unwrap matrices of many cameras loaded, and remaps frames of local clients through shared memory."
+
+DEFINE_string(cameras, "", "Comma separated list of camera_id=unwrap.hdf5 pairs to serve.");
+DEFINE_string(socket, "/tmp/remap_server.sock", "Path of the unix control socket.");
+DEFINE_int64(workers, 0, "Number of remap workers. Zero means the number of cpus.");
+DEFINE_int64(max_batch, 8, "A worker takes up to this many pending frames at once, grouped by camera.");
+DEFINE_bool(fixed_point_map, false, "Convert the unwrap matrices to fixed point, which remaps faster with 1/32 pixel precision.");
+DEFINE_bool(lanczos_table, false, "Remap with precomputed Lanczos windows, faster than opencv's remap with the same 1/32 pixel precision. Takes precedence over fixed_point_map.");
+DEFINE_int64(max_ring_mb, 1024, "A client can't attach with a shared memory ring larger than this, in MiB.");
+
+
+// frame sides a client can attach with. the remap maps hold coordinates as shorts
+static const uint32_t MAX_FRAME_SIDE = SHRT_MAX;
+static const uint32_t MAX_SLOT_COUNT = 1024;
+
+
+static volatile sig_atomic_t terminate_requested = 0;
+
+void request_terminate( int )
+{
+	terminate_requested = 1;
+}
+
+
+// one attached client and its shared memory ring
+struct Client {
+	int socket;
+	std::mutex send_mutex;
+	bool closed = false;
+
+	std::string camera;
+	const UnwrapPlan *plan = nullptr;
+	RemapMessage attached;
+	std::string shm_name;
+	uint8_t *ring = nullptr;
+	size_t ring_bytes = 0;
+
+	~Client()
+	{
+		if( ring!=nullptr )
+		{
+			munmap( ring, ring_bytes );
+			shm_unlink( shm_name.c_str() );
+		}
+		close( socket );
+	}
+
+	void send_message( const RemapMessage &message )
+	{
+		std::lock_guard<std::mutex> lock( send_mutex );
+		if( !closed )
+		{
+			send( socket, &message, sizeof(message), MSG_NOSIGNAL );
+		}
+	}
+
+	// slot is the frame the error is about, if any
+	void send_error( const std::string &error, uint32_t slot = 0 )
+	{
+		RemapMessage message;
+		memset( &message, 0, sizeof(message) );
+		message.type = REMAP_ERROR;
+		message.slot = slot;
+		strncpy( message.camera, error.c_str(), REMAP_NAME_SIZE-1 );
+		send_message( message );
+	}
+};
+
+struct Job {
+	std::shared_ptr<Client> client;
+	uint32_t slot;
+};
+
+
+class JobQueue
+{
+public:
+	JobQueue() : stopped(false) {}
+
+	void push( const Job &job )
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		jobs.push_back( job );
+		cond.notify_one();
+	}
+
+	// takes up to max_batch jobs, blocks while there are none. returns false once stopped
+	bool pop_batch( size_t max_batch, std::vector<Job> &batch )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		cond.wait( lock, [this]{ return !jobs.empty() || stopped; } );
+		if( stopped )
+		{
+			return false;
+		}
+		batch.clear();
+		while( !jobs.empty() && batch.size()<max_batch )
+		{
+			batch.push_back( jobs.front() );
+			jobs.pop_front();
+		}
+		return true;
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		stopped = true;
+		cond.notify_all();
+	}
+
+private:
+	std::deque<Job> jobs;
+	bool stopped;
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+
+void remap_worker( JobQueue &queue )
+{
+	std::vector<Job> batch;
+	while( queue.pop_batch( FLAGS_max_batch, batch ) )
+	{
+		// the frames of the same camera go after each other, so its map stays in cache
+		std::stable_sort( batch.begin(), batch.end(), []( const Job &a, const Job &b ) {
+			return a.client->plan < b.client->plan;
+		});
+
+		for( const Job &job : batch )
+		{
+			Client &client = *job.client;
+			const RemapMessage &attached = client.attached;
+			uint8_t *slot = client.ring + job.slot * attached.slot_bytes;
+
+			int type = CV_8UC( attached.channels );
+			cv::Mat input( attached.input_height, attached.input_width, type, slot );
+			cv::Mat output( attached.output_height, attached.output_width, type, slot + remap_input_bytes( attached ) );
+
+			// output has the right size and type, so the remap writes straight into the slot
+			try
+			{
+				client.plan->execute( input, output );
+			}
+			catch( const std::exception &e )
+			{
+				LOG(ERROR) << client.camera << ": remap of slot " << job.slot << " failed: " << e.what();
+				client.send_error( "remap failed", job.slot );
+				continue;
+			}
+
+			RemapMessage done;
+			memset( &done, 0, sizeof(done) );
+			done.type = REMAP_DONE;
+			done.slot = job.slot;
+			client.send_message( done );
+		}
+	}
+}
+
+
+void load_cameras( std::map<std::string, std::unique_ptr<UnwrapPlan> > &plans )
+{
+	MapFormat format = MapFormat::FLOAT;
+	if( FLAGS_lanczos_table )
+	{
+		format = MapFormat::LANCZOS_TABLE;
+	}
+	else if( FLAGS_fixed_point_map )
+	{
+		format = MapFormat::FIXED_POINT;
+	}
+
+	std::stringstream cameras( FLAGS_cameras );
+	std::string camera;
+	while( std::getline( cameras, camera, ',' ) )
+	{
+		size_t separator = camera.find( '=' );
+		CHECK( separator!=std::string::npos ) << "camera should be given as camera_id=unwrap.hdf5: " << camera;
+
+		std::string camera_id = camera.substr( 0, separator );
+		std::string hdf5_path = camera.substr( separator+1 );
+
+		cv::Mat unwrap_map;
+		read_map( hdf5_path, "map", unwrap_map );
+		std::unique_ptr<UnwrapPlan> &plan = plans[camera_id];
+		plan.reset( new UnwrapPlan( unwrap_map, format ) );
+
+		// the span index knows the frame size the map was made for, clients of another size are refused
+		ValidSpans spans;
+		if( read_valid_spans( hdf5_path, spans ) )
+		{
+			plan->set_valid_spans( spans );
+			std::cout << "loaded " << camera_id << " from " << hdf5_path << ", frames " << spans.frame_size << ", output " << unwrap_map.size() << std::endl;
+		}
+		else
+		{
+			std::cout << "loaded " << camera_id << " from " << hdf5_path << ", output " << unwrap_map.size() << ", no span index, the frame size isn't checked" << std::endl;
+		}
+	}
+	CHECK( !plans.empty() ) << "no cameras to serve";
+}
+
+// answers REMAP_ATTACH: creates the shared memory ring for the client
+void attach_client( Client &client, const RemapMessage &request, const std::map<std::string, std::unique_ptr<UnwrapPlan> > &plans )
+{
+	static int shm_counter = 0;
+
+	std::string camera( request.camera, strnlen( request.camera, REMAP_NAME_SIZE ) );
+	auto plan = plans.find( camera );
+	if( plan==plans.end() )
+	{
+		client.send_error( "unknown camera " + camera );
+		return;
+	}
+	if( client.ring!=nullptr )
+	{
+		client.send_error( "already attached" );
+		return;
+	}
+	if( request.slot_count==0 || request.slot_count>MAX_SLOT_COUNT )
+	{
+		client.send_error( "invalid slot count" );
+		return;
+	}
+	if( (request.channels!=1 && request.channels!=3)
+		|| request.input_width==0 || request.input_width>MAX_FRAME_SIDE
+		|| request.input_height==0 || request.input_height>MAX_FRAME_SIDE )
+	{
+		client.send_error( "invalid frame geometry" );
+		return;
+	}
+	const ValidSpans &spans = plan->second->valid_spans();
+	if( !spans.empty() && ( (int)request.input_width!=spans.frame_size.width || (int)request.input_height!=spans.frame_size.height ) )
+	{
+		std::stringstream error;
+		error << "frames should be " << spans.frame_size.width << "x" << spans.frame_size.height;
+		client.send_error( error.str() );
+		return;
+	}
+
+	client.camera = camera;
+	client.plan = plan->second.get();
+
+	RemapMessage &attached = client.attached;
+	attached = request;
+	attached.type = REMAP_ATTACHED;
+	attached.output_width = client.plan->output_size().width;
+	attached.output_height = client.plan->output_size().height;
+	// slots are page aligned
+	uint64_t page = sysconf( _SC_PAGESIZE );
+	attached.slot_bytes = ( remap_input_bytes( attached ) + remap_output_bytes( attached ) + page - 1 ) / page * page;
+	// sides and slot count are bounded, so this doesn't overflow
+	uint64_t ring_bytes = attached.slot_bytes * attached.slot_count;
+	if( ring_bytes>(uint64_t)FLAGS_max_ring_mb << 20 )
+	{
+		client.send_error( "ring too large, use fewer slots" );
+		return;
+	}
+
+	std::stringstream shm_name;
+	shm_name << "/remap_server_" << getpid() << "_" << shm_counter++;
+	client.shm_name = shm_name.str();
+	strncpy( attached.shm_name, client.shm_name.c_str(), REMAP_NAME_SIZE-1 );
+
+	int fd = shm_open( client.shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+	if( fd<0 )
+	{
+		client.send_error( "can't create shared memory" );
+		return;
+	}
+	client.ring_bytes = ring_bytes;
+	void *ring = MAP_FAILED;
+	if( ftruncate( fd, client.ring_bytes )==0 )
+	{
+		ring = mmap( NULL, client.ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	}
+	close( fd );
+	if( ring==MAP_FAILED )
+	{
+		shm_unlink( client.shm_name.c_str() );
+		client.send_error( "can't map shared memory" );
+		return;
+	}
+	client.ring = (uint8_t*)ring;
+
+	std::cout << "client attached to " << camera << ", " << attached.slot_count << " slots of " << attached.slot_bytes << " bytes" << std::endl;
+	client.send_message( attached );
+}
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	std::map<std::string, std::unique_ptr<UnwrapPlan> > plans;
+	load_cameras( plans );
+
+	signal( SIGINT, request_terminate );
+	signal( SIGTERM, request_terminate );
+
+	int listener = socket( AF_UNIX, SOCK_SEQPACKET, 0 );
+	CHECK_GE( listener, 0 ) << "can't create socket";
+	struct sockaddr_un address;
+	memset( &address, 0, sizeof(address) );
+	address.sun_family = AF_UNIX;
+	CHECK_LT( FLAGS_socket.size(), sizeof(address.sun_path) ) << "socket path too long";
+	strncpy( address.sun_path, FLAGS_socket.c_str(), sizeof(address.sun_path)-1 );
+	unlink( FLAGS_socket.c_str() );
+	CHECK_EQ( bind( listener, (struct sockaddr*)&address, sizeof(address) ), 0 ) << "can't bind " << FLAGS_socket;
+	CHECK_EQ( listen( listener, 16 ), 0 );
+
+	// the workers remap frame by frame, opencv's own threads would only oversubscribe
+	cv::setNumThreads( 1 );
+
+	JobQueue queue;
+	int worker_count = FLAGS_workers>0 ? FLAGS_workers : std::max( 1, cv::getNumberOfCPUs() );
+	std::vector<std::thread> workers;
+	for( int i=0; i<worker_count; i++ )
+	{
+		workers.push_back( std::thread( remap_worker, std::ref( queue ) ) );
+	}
+
+	std::cout << "serving on " << FLAGS_socket << " with " << worker_count << " workers" << std::endl;
+
+	std::vector<std::shared_ptr<Client> > clients;
+	while( !terminate_requested )
+	{
+		std::vector<struct pollfd> fds( 1 + clients.size() );
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for( size_t i=0; i<clients.size(); i++ )
+		{
+			fds[i+1].fd = clients[i]->socket;
+			fds[i+1].events = POLLIN;
+		}
+
+		if( poll( fds.data(), fds.size(), 500 )<=0 )
+		{
+			continue;
+		}
+
+		std::vector<std::shared_ptr<Client> > alive;
+		for( size_t i=0; i<clients.size(); i++ )
+		{
+			std::shared_ptr<Client> &client = clients[i];
+			if( fds[i+1].revents==0 )
+			{
+				alive.push_back( client );
+				continue;
+			}
+
+			RemapMessage message;
+			ssize_t received = recv( client->socket, &message, sizeof(message), 0 );
+			if( received<=0 )
+			{
+				// disconnected. frames still in flight keep the client alive until they are done
+				std::lock_guard<std::mutex> lock( client->send_mutex );
+				client->closed = true;
+				continue;
+			}
+			alive.push_back( client );
+
+			if( received!=sizeof(message) )
+			{
+				client->send_error( "malformed message" );
+			}
+			else if( message.type==REMAP_ATTACH )
+			{
+				attach_client( *client, message, plans );
+			}
+			else if( message.type==REMAP_SUBMIT && client->ring!=nullptr && message.slot<client->attached.slot_count )
+			{
+				Job job;
+				job.client = client;
+				job.slot = message.slot;
+				queue.push( job );
+			}
+			else
+			{
+				client->send_error( "unexpected message" );
+			}
+		}
+		clients.swap( alive );
+
+		if( fds[0].revents & POLLIN )
+		{
+			int socket = accept( listener, NULL, NULL );
+			if( socket>=0 )
+			{
+				std::shared_ptr<Client> client = std::make_shared<Client>();
+				client->socket = socket;
+				clients.push_back( client );
+			}
+		}
+	}
+
+	std::cout << "shutting down" << std::endl;
+	queue.stop();
+	for( std::thread &worker : workers )
+	{
+		worker.join();
+	}
+	clients.clear();
+	close( listener );
+	unlink( FLAGS_socket.c_str() );
+}
@@ -7,13 +7,18 @@
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <algorithm>
+#include <memory>
 
 #include <opencv2/opencv.hpp>
 
 #include "opencvhdfs.h"
+#include "map_io.h"
 
 #include "lines.h"
 #include "undistort.h"
+#include "unwrap_plan.h"
+#include "calibration_io.h"
 
 #include "version.h"
 
@@ -22,10 +27,10 @@
 DEFINE_string(input, "", "Directory where the frames are stored");
 DEFINE_string(output_hdf5, "", "Path to the hdf5 file storing the rectification maps.");
 
-DEFINE_string(left_unwrap, "", "Left unwrap hdf5 matrix");
+DEFINE_string(left_unwrap, "", "Left unwrap hdf5 matrix. If empty, it is synthesized from left_xml.");
 DEFINE_string(left_xml, "", "Left unwrap parameters in xml");
 
-DEFINE_string(right_unwrap, "", "Right unwrap hdf5 matrix");
+DEFINE_string(right_unwrap, "", "Right unwrap hdf5 matrix. If empty, it is synthesized from right_xml.");
 DEFINE_string(right_xml, "", "Right unwrap parameters in xml");
 
 DEFINE_int64(board_width, 10, "Checkerboard width");
@@ -34,8 +39,12 @@ DEFINE_double(square_size, 24., "Checkerboard cell size in mm");
 
 DEFINE_int64(max_frame_count, 10, "Max number of frames used for calibration.");
 
+DEFINE_int64(batch_size, 0, "Number of frame pairs processed concurrently. Zero means the number of cpus.");
+
 DEFINE_double(unwrap_factor, 1.0, "How big the unwrapped image should be? 0=only valid pixels  1=whole frame unwrapped. Has to be the same as used for the hdf5 maps.");
 
+DEFINE_bool(raw_corners, false, "Detect the corners on the original frames, and unwrap only the corner points. The unwrap hdf5 maps are not needed then.");
+
 
 bool extract_corners(cv::Mat &frame, cv::Size boardSize, std::vector<cv::Point2f> &pointbuf)
 {
@@ -54,18 +63,67 @@ bool extract_corners(cv::Mat &frame, cv::Size boardSize, std::vector<cv::Point2f
 	return true;
 }
 
-void read_undistorsion_factors(std::string filename, double undistorsion_factors[], cv::Size &size)
+// everything needed to bring one camera's frames into unwrapped coordinates
+struct EyeUnwrap {
+	std::unique_ptr<UnwrapPlan> plan;
+	double undistorsion_factors[MODEL_SIZE];
+	cv::Rect2d unwrap_rectangle;
+};
+
+// one eye of one frame pair. filled by process_eye, possibly on a worker thread
+struct EyeJob {
+	std::string path;
+	cv::Size image_size;
+	std::vector<cv::Point2f> pointbuf;
+	bool found = false;
+};
+
+void process_eye(EyeJob &job, const EyeUnwrap &eye, cv::Size boardSize)
 {
-	cv::FileStorage fs(filename, cv::FileStorage::READ);
-	fs["cx"] >> undistorsion_factors[0];
-	fs["cy"] >> undistorsion_factors[1];
-	fs["k1"] >> undistorsion_factors[2];
-	fs["k2"] >> undistorsion_factors[3];
-
-	fs["width"] >> size.width;
-	fs["height"] >> size.height;
+	cv::Mat frame = cv::imread( job.path );
+	CHECK( !frame.empty() ) << "can't read " << job.path;
+
+	if( FLAGS_raw_corners )
+	{
+		// same size prepare_unwrap would give to the unwrapped image
+		job.image_size = cv::Size( (int)eye.unwrap_rectangle.width, (int)eye.unwrap_rectangle.height );
+		job.found = extract_corners( frame, boardSize, job.pointbuf );
+
+		for( cv::Point2f &point : job.pointbuf )
+		{
+			cv::Point2d unwrapped = undistort( eye.undistorsion_factors, cv::Point2d( point.x, point.y ) ) - eye.unwrap_rectangle.tl();
+			point = cv::Point2f( unwrapped.x, unwrapped.y );
+		}
+		return;
+	}
+
+	cv::Mat unwrapped;
+	eye.plan->execute( frame, unwrapped );
+
+	job.image_size = unwrapped.size();
+	job.found = extract_corners( unwrapped, boardSize, job.pointbuf );
 }
 
+// even jobs are left eyes, odd jobs are right eyes
+class EyeJobBody : public cv::ParallelLoopBody
+{
+public:
+	EyeJobBody( std::vector<EyeJob> &jobs, const EyeUnwrap eyes[2], cv::Size boardSize )
+		: jobs(jobs), eyes(eyes), boardSize(boardSize) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int job_idx = range.start; job_idx < range.end; job_idx++ )
+		{
+			process_eye( jobs[job_idx], eyes[ job_idx % 2 ], boardSize );
+		}
+	}
+
+private:
+	std::vector<EyeJob> &jobs;
+	const EyeUnwrap *eyes;
+	cv::Size boardSize;
+};
 
 int main(int argc, char** argv )
 {
@@ -79,57 +137,111 @@ int main(int argc, char** argv )
 	double  undistorsion_factors[2][MODEL_SIZE];
 	cv::Size original_image_size[2];
 
-	read_undistorsion_factors( FLAGS_left_xml, undistorsion_factors[0], original_image_size[0] );
-	read_undistorsion_factors( FLAGS_right_xml, undistorsion_factors[1], original_image_size[1] );
+	CHECK( read_calibration( FLAGS_left_xml, undistorsion_factors[0], original_image_size[0] ) ) << "can't read " << FLAGS_left_xml;
+	CHECK( read_calibration( FLAGS_right_xml, undistorsion_factors[1], original_image_size[1] ) ) << "can't read " << FLAGS_right_xml;
 
-	cv::Mat left_unwrap_map;
-	CVHDFS::read( FLAGS_left_unwrap, "map", left_unwrap_map);
+	EyeUnwrap eyes[2];
+	for( int eye=0; eye<2; eye++ )
+	{
+		std::copy( undistorsion_factors[eye], undistorsion_factors[eye] + MODEL_SIZE, eyes[eye].undistorsion_factors );
+		eyes[eye].unwrap_rectangle = unwrap_rectangle( undistorsion_factors[eye], original_image_size[eye], FLAGS_unwrap_factor );
+	}
 
-	cv::Mat right_unwrap_map;
-	CVHDFS::read( FLAGS_right_unwrap, "map", right_unwrap_map);
+	if( !FLAGS_raw_corners )
+	{
+		std::string unwrap_paths[2] = { FLAGS_left_unwrap, FLAGS_right_unwrap };
+		for( int eye=0; eye<2; eye++ )
+		{
+			if( unwrap_paths[eye].size()>0 )
+			{
+				cv::Mat unwrap_map;
+				read_map( unwrap_paths[eye], "map", unwrap_map );
+				eyes[eye].plan.reset( new UnwrapPlan( unwrap_map ) );
+			}
+			else
+			{
+				UnwrapPlanOptions options;
+				options.inverse = InverseMethod::NEWTON;
+				eyes[eye].plan.reset( new UnwrapPlan( undistorsion_factors[eye], original_image_size[eye], FLAGS_unwrap_factor, options ) );
+			}
+		}
+	}
 
 	std::vector<std::vector<cv::Point2f> > left_imagePoints, right_imagePoints;
 
 	cv::Size boardSize( FLAGS_board_width, FLAGS_board_height );
 	cv::Size left_imageSize, right_imageSize, imageSize;
 
-	std::string left_pattern = FLAGS_input+"/*_l.png";
+	// any output_format of stereo_checkerboard_extractor
+	std::string left_pattern = FLAGS_input+"/*_l.*";
 
+	std::vector<std::string> left_paths;
 	glob_t results;
 	CHECK( !glob(left_pattern.c_str(), 0, NULL, &results) ) << "For some reason can't glob the input pattern";
 	for (int pattern_idx = 0; pattern_idx < results.gl_pathc; pattern_idx++)
 	{
-		std::string left_path( results.gl_pathv[pattern_idx] );
+		std::string path( results.gl_pathv[pattern_idx] );
+		// frames the extractor didn't finish writing are *_l.<ext>.tmp
+		size_t dot = path.find_last_of( '.' );
+		if( dot<2 || path.compare( dot - 2, 2, "_l" )!=0 )
+		{
+			continue;
+		}
+		left_paths.push_back( path );
+	}
+	globfree( &results);
 
-		std::string right_path( left_path );
-		right_path.replace( left_path.size() - 5, 1, "r");
+	int batch_size = FLAGS_batch_size>0 ? FLAGS_batch_size : std::max( 1, cv::getNumberOfCPUs() );
 
-		std::cout << left_path << " " << right_path << std::endl;
+	// the pairs are processed in batches. within a batch every eye of every pair is an independent
+	// job, so left and right run concurrently. results are collected in glob order after each batch,
+	// so the calibration input doesn't depend on scheduling, and we can stop as soon as we have enough.
+	for (size_t batch_start = 0; batch_start < left_paths.size(); batch_start += batch_size)
+	{
+		if( left_imagePoints.size() >= FLAGS_max_frame_count )
+		{
+			break;
+		}
 
-		cv::Mat left_frame = cv::imread( left_path );
-		cv::Mat right_frame = cv::imread( right_path );
+		size_t batch_end = std::min( left_paths.size(), batch_start + batch_size );
+		std::vector<EyeJob> jobs( 2 * (batch_end - batch_start) );
 
-		CHECK( !left_frame.empty() );
-		CHECK( !right_frame.empty() );
+		for (size_t pair_idx = batch_start; pair_idx < batch_end; pair_idx++)
+		{
+			std::string left_path( left_paths[pair_idx] );
 
-		cv::remap(left_frame, left_frame, left_unwrap_map, cv::Mat(), cv::INTER_LANCZOS4);
-		cv::remap(right_frame, right_frame, right_unwrap_map, cv::Mat(), cv::INTER_LANCZOS4);
+			// the same name with _r before the extension, whatever its length
+			std::string right_path( left_path );
+			right_path.replace( left_path.find_last_of( '.' ) - 1, 1, "r");
 
-		left_imageSize = left_frame.size();
-		right_imageSize = right_frame.size();
+			jobs[ 2 * (pair_idx - batch_start) ].path = left_path;
+			jobs[ 2 * (pair_idx - batch_start) + 1 ].path = right_path;
+		}
 
-		std::vector<cv::Point2f> left_pointbuf, right_pointbuf;
+		cv::parallel_for_( cv::Range(0, jobs.size()), EyeJobBody( jobs, eyes, boardSize ) );
+
+		for (size_t job_idx = 0; job_idx < jobs.size(); job_idx += 2)
+		{
+			EyeJob &left_job = jobs[job_idx];
+			EyeJob &right_job = jobs[job_idx + 1];
 
-		bool left_found = extract_corners( left_frame, boardSize, left_pointbuf);
-		bool right_found = extract_corners( right_frame, boardSize, right_pointbuf);
+			std::cout << left_job.path << " " << right_job.path << std::endl;
 
-		if( left_found && right_found ) {
-			std::cout << "    found." << std::endl;
-			left_imagePoints.push_back( left_pointbuf );
-			right_imagePoints.push_back( right_pointbuf );
+			left_imageSize = left_job.image_size;
+			right_imageSize = right_job.image_size;
+
+			if( left_job.found && right_job.found ) {
+				std::cout << "    found." << std::endl;
+				left_imagePoints.push_back( left_job.pointbuf );
+				right_imagePoints.push_back( right_job.pointbuf );
+
+				if( left_imagePoints.size() >= FLAGS_max_frame_count )
+				{
+					break;
+				}
+			}
 		}
 	}
-	globfree( &results);
 
 	imageSize.width = std::max( left_imageSize.width, right_imageSize.width );
 	imageSize.height = std::max( left_imageSize.height, right_imageSize.height );
@@ -229,6 +341,8 @@ int main(int argc, char** argv )
 	);
 
 
+	ProgressContext progress = console_progress( false );
+
 	cv::Mat full_rectification_map[2];
 	cv::Mat full_rectification_mask[2];
 
@@ -239,7 +353,8 @@ int main(int argc, char** argv )
 		original_image_size[0],
 		FLAGS_unwrap_factor,
 		full_rectification_map[0],
-		full_rectification_mask[0]
+		full_rectification_mask[0],
+		&progress
 	);
 
 	std::cout << "concatenating rectification and unwrap map, right" << std::endl;
@@ -249,7 +364,8 @@ int main(int argc, char** argv )
 		original_image_size[1],
 		FLAGS_unwrap_factor,
 		full_rectification_map[1],
-		full_rectification_mask[1]
+		full_rectification_mask[1],
+		&progress
 	);
 
 	CVHDFS::write( FLAGS_output_hdf5, "map_left", full_rectification_map[0]);
@@ -2,10 +2,19 @@
 #include "glog/logging.h"
 
 #include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
 #include <iostream>
 #include <vector>
 #include <sstream>
 #include <iomanip>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
 
 #include <opencv2/opencv.hpp>
 
@@ -23,6 +32,292 @@ DEFINE_string(output, "", "Path for the directory, where the extracted frames wi
 
 DEFINE_int64(board_width, 10, "Checkerboard width");
 DEFINE_int64(board_height, 7, "Checkerboard height");
+DEFINE_double(precheck_scale, 0.5, "Frames are downscaled by this factor for a fast checkerboard pre-check before the full resolution detection. Zero disables the pre-check.");
+DEFINE_int64(decode_queue_size, 8, "Number of decoded frames buffered ahead per stream.");
+DEFINE_string(output_format, "png", "Format of the extracted frames: png, webp (lossless) or ppm (raw, fastest).");
+DEFINE_int64(png_compression, 3, "Compression level of png output, 0 (fastest) to 9 (smallest).");
+DEFINE_int64(writer_threads, 2, "Number of threads encoding and writing the extracted frames.");
+DEFINE_int64(writer_queue_size, 8, "Number of frames waiting to be written, before the detection waits for the writers.");
+DEFINE_bool(fsync, true, "Flush every written frame to the disk, so the frames are complete once the program exits, even on power loss.");
+
+
+/*
+	Reads every stride. frame of a video, starting at first_frame_idx, on its own thread.
+	Only the first position is seeked, after that the skipped frames are grab()-ed, which avoids
+	the keyframe seek + decode a CAP_PROP_POS_FRAMES set costs on long-GOP footage.
+	Decoded frames are buffered in a bounded queue, so the decoder runs ahead of the detection,
+	but not unbounded.
+*/
+class SequentialReader
+{
+public:
+	SequentialReader( cv::VideoCapture &cap, int64_t first_frame_idx, int64_t stride, int64_t last_frame_idx, size_t queue_size )
+		: cap(cap), next_frame_idx(first_frame_idx), stride(stride), last_frame_idx(last_frame_idx),
+		queue_size(queue_size), finished(false), stopped(false)
+	{
+		worker = std::thread( &SequentialReader::run, this );
+	}
+
+	~SequentialReader()
+	{
+		stop();
+		worker.join();
+	}
+
+	// blocks until the next frame is decoded. returns false if the stream ran dry
+	bool next( cv::Mat &frame, int64_t &frame_idx )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		cond.wait( lock, [this]{ return !queue.empty() || finished; } );
+		if( queue.empty() )
+		{
+			return false;
+		}
+		frame = queue.front().first;
+		frame_idx = queue.front().second;
+		queue.pop_front();
+		cond.notify_all();
+		return true;
+	}
+
+	void stop()
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		stopped = true;
+		cond.notify_all();
+	}
+
+private:
+	void run()
+	{
+		bool ok = cap.set( cv::CAP_PROP_POS_FRAMES, next_frame_idx );
+		while( ok )
+		{
+			if( last_frame_idx>0 && next_frame_idx>last_frame_idx )
+			{
+				break;
+			}
+
+			cv::Mat frame;
+			if( !cap.read( frame ) )
+			{
+				break;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock( mutex );
+				cond.wait( lock, [this]{ return queue.size()<queue_size || stopped; } );
+				if( stopped )
+				{
+					break;
+				}
+				queue.push_back( std::make_pair( frame, next_frame_idx ) );
+				cond.notify_all();
+			}
+
+			// skip the frames in between without seeking
+			for( int64_t i=1; i<stride && ok; i++ )
+			{
+				ok = cap.grab();
+			}
+			next_frame_idx += stride;
+		}
+
+		std::lock_guard<std::mutex> lock( mutex );
+		finished = true;
+		cond.notify_all();
+	}
+
+	cv::VideoCapture &cap;
+	int64_t next_frame_idx;
+	const int64_t stride;
+	const int64_t last_frame_idx;
+	const size_t queue_size;
+
+	std::deque< std::pair<cv::Mat, int64_t> > queue;
+	bool finished;
+	bool stopped;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::thread worker;
+};
+
+
+/*
+	Encodes and writes frames on a few background threads, so the detection doesn't wait for the
+	compression and the disk. write() blocks while the queue is full, which keeps memory bounded.
+	Every frame is written to a temporary file, flushed, and renamed into place, so a file either
+	exists complete or not at all. finish() returns once everything is on the disk.
+	Frames go to a single directory, that is flushed by finish().
+*/
+class ImageWriterPool
+{
+public:
+	ImageWriterPool( const std::string &extension, const std::vector<int> &params, int threads, size_t queue_size, bool sync )
+		: extension(extension), params(params), queue_size(queue_size), sync(sync), stopped(false)
+	{
+		for( int i=0; i<std::max( threads, 1 ); i++ )
+		{
+			workers.push_back( std::thread( &ImageWriterPool::run, this ) );
+		}
+	}
+
+	~ImageWriterPool()
+	{
+		finish();
+	}
+
+	// path is without the extension
+	void write( const std::string &path, const cv::Mat &frame )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+		cond.wait( lock, [this]{ return queue.size()<queue_size; } );
+		queue.push_back( std::make_pair( path + extension, frame ) );
+		directory = path.substr( 0, path.find_last_of( '/' ) + 1 );
+		cond.notify_all();
+	}
+
+	void finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			if( stopped )
+			{
+				return;
+			}
+			stopped = true;
+			cond.notify_all();
+		}
+		for( std::thread &worker : workers )
+		{
+			worker.join();
+		}
+
+		if( sync && !directory.empty() )
+		{
+			// the renames are only durable once the directory is flushed too
+			int directory_fd = open( directory.c_str(), O_RDONLY );
+			if( directory_fd>=0 )
+			{
+				fsync( directory_fd );
+				close( directory_fd );
+			}
+		}
+	}
+
+private:
+	void run()
+	{
+		std::vector<uchar> buffer;
+		while( true )
+		{
+			std::pair<std::string, cv::Mat> job;
+			{
+				std::unique_lock<std::mutex> lock( mutex );
+				cond.wait( lock, [this]{ return !queue.empty() || stopped; } );
+				if( queue.empty() )
+				{
+					return;
+				}
+				job = queue.front();
+				queue.pop_front();
+				cond.notify_all();
+			}
+
+			CHECK( cv::imencode( extension, job.second, buffer, params ) ) << "can't encode " << job.first;
+			write_file( job.first, buffer );
+		}
+	}
+
+	void write_file( const std::string &path, const std::vector<uchar> &buffer )
+	{
+		std::string temporary = path + ".tmp";
+		int fd = open( temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		CHECK_GE( fd, 0 ) << "can't write " << temporary;
+
+		size_t written = 0;
+		while( written<buffer.size() )
+		{
+			ssize_t result = ::write( fd, buffer.data() + written, buffer.size() - written );
+			CHECK_GT( result, 0 ) << "can't write " << temporary;
+			written += result;
+		}
+		if( sync )
+		{
+			CHECK_EQ( fsync( fd ), 0 ) << "can't flush " << temporary;
+		}
+		close( fd );
+
+		CHECK_EQ( rename( temporary.c_str(), path.c_str() ), 0 ) << "can't rename " << temporary;
+	}
+
+	const std::string extension;
+	const std::vector<int> params;
+	const size_t queue_size;
+	const bool sync;
+
+	std::deque< std::pair<std::string, cv::Mat> > queue;
+	std::string directory; // of the written frames
+	bool stopped;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<std::thread> workers;
+};
+
+ImageWriterPool *create_writer_pool()
+{
+	std::string extension;
+	std::vector<int> params;
+	if( FLAGS_output_format=="png" )
+	{
+		extension = ".png";
+		params = { cv::IMWRITE_PNG_COMPRESSION, (int)FLAGS_png_compression };
+	}
+	else if( FLAGS_output_format=="webp" )
+	{
+		// quality above 100 is lossless
+		extension = ".webp";
+		params = { cv::IMWRITE_WEBP_QUALITY, 101 };
+	}
+	else if( FLAGS_output_format=="ppm" )
+	{
+		extension = ".ppm";
+		params = { cv::IMWRITE_PXM_BINARY, 1 };
+	}
+	else
+	{
+		LOG(FATAL) << "unknown output_format " << FLAGS_output_format;
+	}
+	return new ImageWriterPool( extension, params, FLAGS_writer_threads, FLAGS_writer_queue_size, FLAGS_fsync );
+}
+
+
+// cheap rejection of frames without a checkerboard on a downscaled copy
+bool precheck_corners( const cv::Mat &frame, cv::Size boardSize )
+{
+	if( FLAGS_precheck_scale<=0.0 )
+	{
+		return true;
+	}
+
+	cv::Mat small;
+	cv::resize( frame, small, cv::Size(), FLAGS_precheck_scale, FLAGS_precheck_scale, cv::INTER_AREA );
+
+	std::vector<cv::Point2f> pointbuf;
+	return cv::findChessboardCorners( small, boardSize, pointbuf,
+		cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK );
+}
+
+bool find_corners( const cv::Mat &frame, cv::Size boardSize, std::vector<cv::Point2f> &pointbuf )
+{
+	if( !precheck_corners( frame, boardSize ) )
+	{
+		return false;
+	}
+
+	return cv::findChessboardCorners( frame, boardSize, pointbuf,
+		cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE);
+}
 
 int main(int argc, char** argv )
 {
@@ -33,41 +328,36 @@ int main(int argc, char** argv )
 	google::InitGoogleLogging(argv[0]);
 
 	cv::VideoCapture cap_left;
-	int left_frame_idx = 0;
+	int64_t left_frame_idx = 0;
 	CHECK( cap_left.open( FLAGS_input_left ) ) << "can't open left video";
 
 
 	cv::VideoCapture cap_right;
-	int right_frame_idx = 0;
+	int64_t right_frame_idx = 0;
 	CHECK( cap_right.open( FLAGS_input_right ) ) << "can't open right video";
 
 	left_frame_idx = std::max( FLAGS_first_frame, std::abs(FLAGS_frame_diff)+1 );
 	right_frame_idx = left_frame_idx + FLAGS_frame_diff;
-	CHECK( cap_left.set(cv::CAP_PROP_POS_FRAMES, left_frame_idx) );
-	CHECK( cap_right.set(cv::CAP_PROP_POS_FRAMES, right_frame_idx) );
+
+	// the same frames are visited as before: every (skipp_nframe+1). frame after skipping the first skipp_nframe
+	int64_t stride = FLAGS_skipp_nframe + 1;
+	int64_t last_left_frame_idx = FLAGS_last_frame>0 ? FLAGS_last_frame : -1;
+	int64_t last_right_frame_idx = FLAGS_last_frame>0 ? FLAGS_last_frame + FLAGS_frame_diff : -1;
+
+	SequentialReader reader_left( cap_left, left_frame_idx + FLAGS_skipp_nframe, stride, last_left_frame_idx, FLAGS_decode_queue_size );
+	SequentialReader reader_right( cap_right, right_frame_idx + FLAGS_skipp_nframe, stride, last_right_frame_idx, FLAGS_decode_queue_size );
 
 	cv::Mat left_frame;
 	cv::Mat right_frame;
 
 	cv::Size boardSize( FLAGS_board_width, FLAGS_board_height );
 
+	std::unique_ptr<ImageWriterPool> writer( create_writer_pool() );
+
 	while(true)
 	{
-		left_frame_idx += FLAGS_skipp_nframe;
-		right_frame_idx += FLAGS_skipp_nframe;
-
-		if( FLAGS_last_frame>0 && left_frame_idx>FLAGS_last_frame )
-		{
-			break;
-		}
-		if( !cap_left.set(cv::CAP_PROP_POS_FRAMES, left_frame_idx)
-			|| !cap_right.set(cv::CAP_PROP_POS_FRAMES, right_frame_idx))
-		{
-			break;
-		}
-
 		// consume frames until one or the other stream runs dry
-		if( !cap_left.read(left_frame) || !cap_right.read(right_frame) )
+		if( !reader_left.next(left_frame, left_frame_idx) || !reader_right.next(right_frame, right_frame_idx) )
 		{
 			break;
 		}
@@ -78,25 +368,23 @@ int main(int argc, char** argv )
 
 		std::vector<cv::Point2f> left_pointbuf, right_pointbuf;
 
-		bool left_found = cv::findChessboardCorners( left_frame, boardSize, left_pointbuf,
-			cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE);
+		bool left_found = find_corners( left_frame, boardSize, left_pointbuf );
 
-		bool right_found = cv::findChessboardCorners( right_frame, boardSize, right_pointbuf,
-			cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE);
+		bool right_found = find_corners( right_frame, boardSize, right_pointbuf );
 
 		if(left_found && right_found)
 		{
 			std::stringstream left_ss;
 			left_ss << FLAGS_output << "/";
 			left_ss << std::setfill('0') << std::setw(10) << left_frame_idx;
-			left_ss << "_l.png";
-			imwrite( left_ss.str(), left_frame);
+			left_ss << "_l";
+			writer->write( left_ss.str(), left_frame);
 
 			std::stringstream right_ss;
 			right_ss << FLAGS_output << "/";
 			right_ss << std::setfill('0') << std::setw(10) << left_frame_idx;
-			right_ss << "_r.png";
-			imwrite( right_ss.str(), right_frame);
+			right_ss << "_r";
+			writer->write( right_ss.str(), right_frame);
 
             /*d
 
@@ -114,4 +402,7 @@ int main(int argc, char** argv )
 			cv::waitKey(1);
         }
 	}
-}
\ No newline at end of file
+
+	// everything is on the disk once this returns
+	writer->finish();
+}
@@ -0,0 +1,104 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "opencvhdfs.h"
+
+#include "stereo_rectifier.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "rectifies time synchronized stereo videos into one grayscale side by side video, with the maps of stereo_calibration."
+
+DEFINE_string(input_hdf5, "", "Path of the rectification matrices, generated by stereo_calibration.");
+DEFINE_string(input_left, "", "Path for left video");
+DEFINE_string(input_right, "", "Path for right video");
+DEFINE_int64(frame_diff, 0, "Time sync variable. the x. frame on the left video and the (x+frame_diff). frame on the right should belong to the same timestamp.");
+DEFINE_int64(first_frame, 0, "First frame id (on the left video) which will be processed.");
+DEFINE_int64(frames, 0, "Number of frame pairs to rectify. Zero means until one of the videos ends.");
+DEFINE_string(layout, "side_by_side", "Layout of the output: side_by_side or row_interleaved.");
+DEFINE_bool(clahe, false, "Equalize the contrast of the output with CLAHE, like the depth pipeline does.");
+DEFINE_string(output, "", "Output video. If empty, the frames are only timed.");
+DEFINE_double(fps, 30.0, "Frame rate of the output video.");
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	StereoLayout layout = StereoLayout::SIDE_BY_SIDE;
+	if( FLAGS_layout=="row_interleaved" )
+	{
+		layout = StereoLayout::ROW_INTERLEAVED;
+	}
+	else
+	{
+		CHECK( FLAGS_layout=="side_by_side" ) << "unknown layout " << FLAGS_layout;
+	}
+
+	cv::Mat left_map, right_map;
+	CVHDFS::read( FLAGS_input_hdf5, "map_left", left_map );
+	CVHDFS::read( FLAGS_input_hdf5, "map_right", right_map );
+	StereoRectifier rectifier( left_map, right_map, layout );
+
+	cv::VideoCapture cap_left, cap_right;
+	CHECK( cap_left.open( FLAGS_input_left ) ) << "can't open left video";
+	CHECK( cap_right.open( FLAGS_input_right ) ) << "can't open right video";
+	cap_left.set( cv::CAP_PROP_POS_FRAMES, FLAGS_first_frame );
+	cap_right.set( cv::CAP_PROP_POS_FRAMES, FLAGS_first_frame + FLAGS_frame_diff );
+
+	cv::VideoWriter video;
+	if( FLAGS_output.size()>0 )
+	{
+		CHECK( video.open( FLAGS_output, cv::VideoWriter::fourcc( 'M', 'J', 'P', 'G' ), FLAGS_fps, rectifier.output_size(), false ) ) << "can't write " << FLAGS_output;
+	}
+
+	cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE( 2.0, cv::Size( 8, 8 ) );
+
+	// the output is allocated once, and rectified into in place
+	cv::Mat left_frame, right_frame, output( rectifier.output_size(), CV_8UC1 );
+	double rectify_seconds = 0.0;
+	int64_t count = 0;
+	while( FLAGS_frames==0 || count<FLAGS_frames )
+	{
+		if( !cap_left.read( left_frame ) || !cap_right.read( right_frame ) )
+		{
+			break;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		rectifier.rectify( left_frame, right_frame, output );
+		rectify_seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		count++;
+
+		if( FLAGS_clahe )
+		{
+			// per eye, so the histograms of the two eyes don't mix at the seam
+			for( int eye=0; eye<2; eye++ )
+			{
+				cv::Mat view = rectifier.eye_view( output, eye );
+				cv::Mat equalized;
+				clahe->apply( view, equalized );
+				equalized.copyTo( view );
+			}
+		}
+
+		if( video.isOpened() )
+		{
+			video.write( output );
+		}
+	}
+
+	CHECK_GT( count, 0 ) << "no frames read";
+	std::cout << count << " pairs rectified to " << rectifier.output_size() << ", "
+		<< 1000.0 * rectify_seconds / count << "ms per pair" << std::endl;
+}
@@ -0,0 +1,97 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "undistort.h"
+#include "synthetic.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "renders stripe board frames seen through a lens of known model, as pictures or a video, for testing the calibration."
+
+DEFINE_string(output, "", "Output picture or video (.avi, .mp4, .mkv). With more frames pictures get the frame index before the extension.");
+DEFINE_int64(width, 1280, "Frame width.");
+DEFINE_int64(height, 720, "Frame height.");
+DEFINE_double(cx, -1.0, "Distortion center x. Negative means the frame center.");
+DEFINE_double(cy, -1.0, "Distortion center y. Negative means the frame center.");
+DEFINE_double(k1, 1e-7, "Model k1, see undistort.");
+DEFINE_double(k2, 0.0, "Model k2, see undistort.");
+DEFINE_int64(frames, 1, "Number of frames. The stripes turn over half a circle along them.");
+DEFINE_double(period, 80.0, "Stripe period in undistorted pixels.");
+DEFINE_double(blur, 0.0, "Sigma of the gaussian blur in pixels.");
+DEFINE_double(noise, 0.0, "Sigma of the gaussian noise in gray levels.");
+DEFINE_double(vignetting, 0.0, "Brightness loss in the frame corners, 0 to 1.");
+DEFINE_int64(seed, 1, "Seed of the noise and the stripe shifts.");
+DEFINE_double(fps, 10.0, "Frame rate of the video.");
+
+
+bool is_video( const std::string &path )
+{
+	size_t dot = path.find_last_of( '.' );
+	std::string extension = dot==std::string::npos ? "" : path.substr( dot );
+	return extension==".avi" || extension==".mp4" || extension==".mkv";
+}
+
+std::string frame_path( const std::string &path, int index )
+{
+	if( FLAGS_frames<=1 )
+	{
+		return path;
+	}
+	size_t dot = path.find_last_of( '.' );
+	CHECK( dot!=std::string::npos ) << "output needs an extension";
+	return path.substr( 0, dot ) + cv::format( "_%04d", index ) + path.substr( dot );
+}
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	CHECK( FLAGS_output.size()>0 ) << "output is needed";
+
+	StripeTarget base;
+	base.frame_size = cv::Size( FLAGS_width, FLAGS_height );
+	base.undistorsion_factors[0] = FLAGS_cx>=0.0 ? FLAGS_cx : FLAGS_width / 2.0;
+	base.undistorsion_factors[1] = FLAGS_cy>=0.0 ? FLAGS_cy : FLAGS_height / 2.0;
+	base.undistorsion_factors[2] = FLAGS_k1;
+	base.undistorsion_factors[3] = FLAGS_k2;
+	base.period = FLAGS_period;
+	base.blur = FLAGS_blur;
+	base.noise = FLAGS_noise;
+	base.vignetting = FLAGS_vignetting;
+
+	cv::RNG rng( FLAGS_seed );
+
+	cv::VideoWriter video;
+	if( is_video( FLAGS_output ) )
+	{
+		CHECK( video.open( FLAGS_output, cv::VideoWriter::fourcc( 'M', 'J', 'P', 'G' ), FLAGS_fps, base.frame_size ) ) << "can't write " << FLAGS_output;
+	}
+
+	cv::Mat frame;
+	for( int i=0; i<FLAGS_frames; i++ )
+	{
+		render_stripes( stripe_sequence_frame( base, i, FLAGS_frames, rng ), frame, rng );
+		if( video.isOpened() )
+		{
+			video.write( frame );
+		}
+		else
+		{
+			std::string path = frame_path( FLAGS_output, i );
+			CHECK( cv::imwrite( path, frame ) ) << "can't write " << path;
+		}
+	}
+
+	std::cout << FLAGS_frames << " frames of " << base.frame_size << " written, cx " << base.undistorsion_factors[0]
+		<< " cy " << base.undistorsion_factors[1] << " k1 " << base.undistorsion_factors[2] << " k2 " << base.undistorsion_factors[3] << std::endl;
+}
@@ -2,21 +2,429 @@
 #include "glog/logging.h"
 
 #include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
 #include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <sstream>
+#include <memory>
 
 #include <opencv2/opencv.hpp>
 
 #include "opencvhdfs.h"
+#include "map_io.h"
 
 #include "lines.h"
 #include "undistort.h"
+#include "unwrap_plan.h"
+#include "calibration_io.h"
 
 #include "version.h"
 
-#define USAGE_MESSAGE "uses the unwrap matrix generated by lens_undistort and undistorts and image."
+#define USAGE_MESSAGE "uses the unwrap matrix generated by lens_undistort and undistorts images and videos."
 
-DEFINE_string(input, "", "Path of a picture to be undistorted");
+DEFINE_string(input, "", "Path of a picture to be undistorted. With --output it can also be a directory (walked recursively) or a glob pattern of pictures and videos.");
 DEFINE_string(input_hdf5, "", "Path of unwrapping matrix, generated by lens_undistort");
+DEFINE_string(input_xml, "", "Path of the calibration xml, written by lens_undistort. If given, the unwrapping matrix is synthesized from it at startup, and input_hdf5 is only used for comparison.");
+DEFINE_double(unwrap_factor, 1.0, "How big the unwrapped image should be? 0=only valid pixels  1=whole frame unwrapped. Used with input_xml.");
+DEFINE_string(roi, "", "Only this region of the unwrapped image is produced, given as x,y,width,height in unwrapped pixels. Used with input_xml.");
+DEFINE_int64(output_width, 0, "Width the output is scaled to. Zero means no scaling, or keeps the aspect ratio if output_height is given. Used with input_xml.");
+DEFINE_int64(output_height, 0, "Height the output is scaled to. Zero means no scaling, or keeps the aspect ratio if output_width is given. Used with input_xml.");
+DEFINE_string(output, "", "Output directory, mirroring the layout of the input. If empty, the single input picture is shown in a window.");
+DEFINE_int64(threads, 0, "Number of files processed concurrently. Zero means the number of cpus.");
+DEFINE_int64(stream_rows, 0, "Don't load the whole unwrapping matrix, but stream it in strips of this many rows. Best set to the band rows of the matrix. Zero means the whole matrix is loaded.");
+DEFINE_bool(fixed_point_map, false, "Convert the unwrapping matrix to fixed point, which remaps faster with 1/32 pixel precision.");
+DEFINE_bool(lanczos_table, false, "Remap 8 bit frames with precomputed Lanczos windows, faster than opencv's remap with the same 1/32 pixel precision. Takes precedence over fixed_point_map.");
+DEFINE_bool(skip_existing, true, "Skip inputs whose output already exists, so an interrupted run can be resumed.");
+
+
+struct FileStats {
+	std::string input_path;
+	std::string output_path;
+	bool skipped = false;
+	bool failed = false;
+	int64_t frames = 0;
+	int64_t pixels = 0;
+	double seconds = 0.0;
+};
+
+
+bool file_exists( const std::string &path )
+{
+	struct stat st;
+	return stat( path.c_str(), &st )==0;
+}
+
+// where an output is written until it is complete, so an existing output is always a complete one.
+// the extension stays last, the encoder and the container are chosen by it
+std::string temporary_path( const std::string &path )
+{
+	size_t dot = path.find_last_of( '.' );
+	size_t slash = path.find_last_of( '/' );
+	if( dot==std::string::npos || ( slash!=std::string::npos && dot<slash ) )
+	{
+		return path + ".tmp";
+	}
+	return path.substr( 0, dot ) + ".tmp" + path.substr( dot );
+}
+
+// moves a complete temporary output into place, or removes it if it failed
+bool finish_output( const std::string &temporary, const std::string &path, bool succeeded )
+{
+	if( succeeded && rename( temporary.c_str(), path.c_str() )==0 )
+	{
+		return true;
+	}
+	remove( temporary.c_str() );
+	return false;
+}
+
+bool is_directory( const std::string &path )
+{
+	struct stat st;
+	return stat( path.c_str(), &st )==0 && S_ISDIR( st.st_mode );
+}
+
+// mkdir -p for the directory part of path
+void make_parent_directories( const std::string &path )
+{
+	for( size_t pos = path.find('/', 1); pos!=std::string::npos; pos = path.find('/', pos+1) )
+	{
+		std::string dir = path.substr( 0, pos );
+		if( mkdir( dir.c_str(), 0755 )!=0 )
+		{
+			CHECK( errno==EEXIST ) << "can't create directory " << dir;
+		}
+	}
+}
+
+void walk_directory( const std::string &directory, std::vector<std::string> &paths )
+{
+	DIR *dir = opendir( directory.c_str() );
+	CHECK( dir!=NULL ) << "can't open directory " << directory;
+
+	std::vector<std::string> entries;
+	while( struct dirent *entry = readdir( dir ) )
+	{
+		std::string name( entry->d_name );
+		if( name=="." || name==".." )
+		{
+			continue;
+		}
+		entries.push_back( directory + "/" + name );
+	}
+	closedir( dir );
+
+	// readdir order is arbitrary, keep the output listing stable
+	std::sort( entries.begin(), entries.end() );
+	for( const std::string &entry : entries )
+	{
+		if( is_directory( entry ) )
+		{
+			walk_directory( entry, paths );
+		}
+		else
+		{
+			paths.push_back( entry );
+		}
+	}
+}
+
+/*
+	Lists the input files, and the root directory the output layout is relative to.
+	The root of a glob pattern is the directory part preceding the first wildcard.
+*/
+void list_inputs( std::string input, std::vector<std::string> &paths, std::string &root )
+{
+	while( input.size()>1 && input[input.size()-1]=='/' )
+	{
+		input.erase( input.size()-1 );
+	}
+
+	if( is_directory( input ) )
+	{
+		root = input;
+		walk_directory( input, paths );
+		return;
+	}
+
+	size_t wildcard = input.find_first_of( "*?[" );
+	size_t slash = input.rfind( '/', wildcard );
+	root = slash==std::string::npos ? "." : input.substr( 0, slash );
+
+	glob_t results;
+	CHECK( !glob(input.c_str(), 0, NULL, &results) ) << "For some reason can't glob the input pattern";
+	for (int pattern_idx = 0; pattern_idx < results.gl_pathc; pattern_idx++)
+	{
+		paths.push_back( std::string( results.gl_pathv[pattern_idx] ) );
+	}
+	globfree( &results );
+}
+
+std::string relative_path( const std::string &path, const std::string &root )
+{
+	if( root!="." && path.compare( 0, root.size(), root )==0 && path.size()>root.size() && path[root.size()]=='/' )
+	{
+		return path.substr( root.size()+1 );
+	}
+	if( path.compare( 0, 2, "./" )==0 )
+	{
+		return path.substr( 2 );
+	}
+	return path;
+}
+
+// either the map is loaded into plan, or it is streamed through reader
+void unwrap_frame( const cv::Mat &frame, cv::Mat &unwraped, const UnwrapPlan *plan, MapBandReader *reader )
+{
+	if( reader!=NULL )
+	{
+		remap_streaming( frame, unwraped, *reader, FLAGS_stream_rows );
+	}
+	else
+	{
+		plan->execute( frame, unwraped );
+	}
+}
+
+void unwrap_file( const UnwrapPlan *plan, FileStats &stats )
+{
+	std::unique_ptr<MapBandReader> reader;
+	if( FLAGS_stream_rows>0 )
+	{
+		reader.reset( new MapBandReader( FLAGS_input_hdf5, "map" ) );
+	}
+
+	// try to load as image
+	cv::Mat frame = cv::imread( stats.input_path );
+	if( frame.data!=NULL )
+	{
+		cv::Mat unwraped;
+		unwrap_frame( frame, unwraped, plan, reader.get() );
+
+		std::string temporary = temporary_path( stats.output_path );
+		stats.failed = !finish_output( temporary, stats.output_path, cv::imwrite( temporary, unwraped ) );
+		stats.frames = 1;
+		stats.pixels = unwraped.total();
+		return;
+	}
+	// couldn't read, maybe it's a video then?
+
+	cv::VideoCapture cap;
+	if( !cap.open( stats.input_path ) )
+	{
+		// nop, not even a video.
+		stats.failed = true;
+		return;
+	}
+
+	std::string temporary = temporary_path( stats.output_path );
+	cv::VideoWriter writer(
+		temporary,
+		(int)cap.get( cv::CAP_PROP_FOURCC ),
+		cap.get( cv::CAP_PROP_FPS ),
+		reader ? reader->size() : plan->output_size()
+	);
+	if( !writer.isOpened() )
+	{
+		finish_output( temporary, stats.output_path, false );
+		stats.failed = true;
+		return;
+	}
+
+	cv::Mat unwraped;
+	while( cap.read( frame ) )
+	{
+		unwrap_frame( frame, unwraped, plan, reader.get() );
+		writer.write( unwraped );
+
+		stats.frames += 1;
+		stats.pixels += unwraped.total();
+	}
+
+	// the container is only complete once the writer is closed
+	writer.release();
+	stats.failed = !finish_output( temporary, stats.output_path, true );
+}
+
+// ends the line of a timing with the rates, unless there is nothing to divide
+void print_rates( int64_t frames, int64_t pixels, double seconds )
+{
+	if( frames>0 && seconds>0.0 )
+	{
+		std::cout << ", " << ( frames / seconds ) << " fps, " << ( pixels / seconds / 1e6 ) << " Mpix/s";
+	}
+	std::cout << std::endl;
+}
+
+void print_stats( const FileStats &stats )
+{
+	if( stats.skipped )
+	{
+		std::cout << stats.input_path << ": skipped, output exists" << std::endl;
+	}
+	else if( stats.failed )
+	{
+		std::cout << stats.input_path << ": couldn't read or write" << std::endl;
+	}
+	else
+	{
+		std::cout << stats.input_path << ": "
+			<< stats.frames << " frames in " << std::fixed << std::setprecision(2) << stats.seconds << "s";
+		print_rates( stats.frames, stats.pixels, stats.seconds );
+	}
+}
+
+void unwrap_batch( const UnwrapPlan *plan )
+{
+	std::vector<std::string> input_paths;
+	std::string root;
+	list_inputs( FLAGS_input, input_paths, root );
+
+	std::vector<FileStats> stats( input_paths.size() );
+	for( size_t idx=0; idx<input_paths.size(); idx++ )
+	{
+		stats[idx].input_path = input_paths[idx];
+		stats[idx].output_path = FLAGS_output + "/" + relative_path( input_paths[idx], root );
+	}
+
+	size_t worker_count = FLAGS_threads>0 ? FLAGS_threads : std::max( 1, cv::getNumberOfCPUs() );
+	worker_count = std::max( (size_t)1, std::min( worker_count, stats.size() ) );
+	if( worker_count>1 )
+	{
+		// the files are the unit of parallelism, don't oversubscribe the cores with opencv's own threads
+		cv::setNumThreads( 1 );
+	}
+
+	std::atomic<size_t> next_file( 0 );
+	std::mutex print_mutex;
+	auto batch_start = std::chrono::steady_clock::now();
+
+	// the plan is shared read-only between the workers
+	auto worker = [&]() {
+		for( size_t idx = next_file++; idx<stats.size(); idx = next_file++ )
+		{
+			FileStats &file_stats = stats[idx];
+			if( FLAGS_skip_existing && file_exists( file_stats.output_path ) )
+			{
+				file_stats.skipped = true;
+			}
+			else
+			{
+				make_parent_directories( file_stats.output_path );
+
+				auto start = std::chrono::steady_clock::now();
+				unwrap_file( plan, file_stats );
+				file_stats.seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+			}
+
+			std::lock_guard<std::mutex> lock( print_mutex );
+			print_stats( file_stats );
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for( size_t i=0; i<worker_count; i++ )
+	{
+		workers.push_back( std::thread( worker ) );
+	}
+	for( std::thread &thread : workers )
+	{
+		thread.join();
+	}
+
+	double wall_seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - batch_start ).count();
+
+	int processed = 0, skipped = 0, failed = 0;
+	int64_t frames = 0, pixels = 0;
+	for( const FileStats &file_stats : stats )
+	{
+		skipped += file_stats.skipped;
+		failed += file_stats.failed;
+		if( !file_stats.skipped && !file_stats.failed )
+		{
+			processed += 1;
+			frames += file_stats.frames;
+			pixels += file_stats.pixels;
+		}
+	}
+
+	std::cout << "processed " << processed << " files, skipped " << skipped << ", failed " << failed << std::endl;
+	std::cout << frames << " frames in " << std::fixed << std::setprecision(2) << wall_seconds << "s on "
+		<< worker_count << " workers";
+	print_rates( frames, pixels, wall_seconds );
+}
+
+
+// builds the plan from the calibration xml, and compares it with the hdf5 map if there is one
+std::unique_ptr<UnwrapPlan> synthesize_plan( MapFormat format )
+{
+	double undistorsion_factors[MODEL_SIZE];
+	cv::Size frame_size;
+	CHECK( read_calibration( FLAGS_input_xml, undistorsion_factors, frame_size ) ) << "can't read " << FLAGS_input_xml;
+
+	UnwrapPlanOptions options;
+	options.format = format;
+	options.inverse = InverseMethod::NEWTON;
+
+	// the whole unwrapped image, unless a roi is given
+	cv::Size unwrapped_size = unwrap_grid( undistorsion_factors, frame_size, FLAGS_unwrap_factor ).size;
+	cv::Rect2d roi( 0, 0, unwrapped_size.width, unwrapped_size.height );
+	if( FLAGS_roi.size()>0 )
+	{
+		char separator;
+		std::stringstream roi_stream( FLAGS_roi );
+		roi_stream >> roi.x >> separator >> roi.y >> separator >> roi.width >> separator >> roi.height;
+		CHECK( !roi_stream.fail() ) << "roi should be given as x,y,width,height";
+	}
+	options.roi = roi;
+	options.output_size = cv::Size( FLAGS_output_width, FLAGS_output_height );
+	if( options.output_size.width==0 && options.output_size.height>0 )
+	{
+		options.output_size.width = (int)( roi.width * options.output_size.height / roi.height );
+	}
+	if( options.output_size.height==0 && options.output_size.width>0 )
+	{
+		options.output_size.height = (int)( roi.height * options.output_size.width / roi.width );
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::unique_ptr<UnwrapPlan> plan( new UnwrapPlan( undistorsion_factors, frame_size, FLAGS_unwrap_factor, options ) );
+	double milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+	std::cout << "synthesized " << plan->output_size() << " map in " << milliseconds << "ms" << std::endl;
+
+	if( FLAGS_input_hdf5.size()>0 )
+	{
+		cv::Mat unwrap_map;
+		read_map( FLAGS_input_hdf5, "map", unwrap_map );
+		if( unwrap_map.size()!=plan->output_size() )
+		{
+			std::cout << "hdf5 map is " << unwrap_map.size() << ", was unwrap_factor the same?" << std::endl;
+		}
+		else
+		{
+			cv::Mat difference;
+			cv::absdiff( unwrap_map, plan->map(), difference );
+			double max_difference;
+			cv::minMaxLoc( difference.reshape( 1 ), NULL, &max_difference );
+			cv::Scalar mean_difference = cv::mean( difference );
+			std::cout << "difference from hdf5 map: max " << max_difference
+				<< "px, mean " << (mean_difference[0] + mean_difference[1]) / 2.0 << "px" << std::endl;
+		}
+	}
+
+	return plan;
+}
 
 
 int main(int argc, char** argv )
@@ -27,16 +435,63 @@ int main(int argc, char** argv )
 	gflags::ParseCommandLineFlags(&argc, &argv, true);
 	google::InitGoogleLogging(argv[0]);
 
-	
 
-	cv::Mat unwrap_map;
-	CVHDFS::read( FLAGS_input_hdf5, "map", unwrap_map);
+
+	MapFormat format = MapFormat::FLOAT;
+	if( FLAGS_lanczos_table )
+	{
+		format = MapFormat::LANCZOS_TABLE;
+	}
+	else if( FLAGS_fixed_point_map )
+	{
+		format = MapFormat::FIXED_POINT;
+	}
+
+	std::unique_ptr<UnwrapPlan> plan;
+	if( FLAGS_input_xml.size()>0 )
+	{
+		// the map is streamed only from hdf5
+		CHECK_LE( FLAGS_stream_rows, 0 ) << "stream_rows can't be used with input_xml, the synthesized map is in memory anyway";
+
+		plan = synthesize_plan( format );
+	}
+	else if( FLAGS_stream_rows<=0 )
+	{
+		cv::Mat unwrap_map;
+		read_map( FLAGS_input_hdf5, "map", unwrap_map );
+		plan.reset( new UnwrapPlan( unwrap_map, format ) );
+
+		// older maps have no span index, they are remapped whole
+		ValidSpans spans;
+		if( read_valid_spans( FLAGS_input_hdf5, spans ) )
+		{
+			plan->set_valid_spans( spans );
+		}
+	}
+
+	if( plan && !plan->valid_spans().empty() )
+	{
+		std::cout << "remapping " << 100.0 * plan->valid_spans().coverage( plan->output_size().width )
+			<< "% of the output, for " << plan->valid_spans().frame_size << " frames" << std::endl;
+	}
+
+	if( FLAGS_output.size()>0 )
+	{
+		unwrap_batch( plan.get() );
+		return 0;
+	}
+
+	std::unique_ptr<MapBandReader> reader;
+	if( FLAGS_stream_rows>0 )
+	{
+		reader.reset( new MapBandReader( FLAGS_input_hdf5, "map" ) );
+	}
 
 	cv::Mat frame = cv::imread( FLAGS_input );
 	cv::Mat unwraped;
 
-	cv::remap(frame, unwraped, unwrap_map, cv::Mat(), cv::INTER_LANCZOS4);
+	unwrap_frame( frame, unwraped, plan.get(), reader.get() );
 
 	cv::imshow( "unwraped", unwraped );
 	cv::waitKey(0);
-}
\ No newline at end of file
+}
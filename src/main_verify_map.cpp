@@ -0,0 +1,84 @@
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "opencvhdfs.h"
+#include "map_io.h"
+
+#include "undistort.h"
+#include "calibration_io.h"
+#include "map_verify.h"
+
+#include "version.h"
+
+#define USAGE_MESSAGE "checks an unwrapping matrix against the forward model of its calibration: round trip error statistics, non converged pixels and mask inconsistencies. exits with failure if the map doesn't pass."
+
+DEFINE_string(input_xml, "", "Path of the calibration xml, written by lens_undistort.");
+DEFINE_string(input_hdf5, "", "Path of the unwrapping matrix to check, generated by lens_undistort. If empty, the map is generated from input_xml with the inverse method, and timed.");
+DEFINE_string(inverse, "newton", "How the map is generated without input_hdf5: newton or solver.");
+DEFINE_double(unwrap_factor, 1.0, "Unwrap factor the map was generated with.");
+DEFINE_double(tolerance, 1e-3, "A pixel of a larger round trip error didn't converge, in unwrapped pixels.");
+DEFINE_double(max_error, 0.01, "The map passes if no pixel inside the frame has a larger round trip error than this, and the mask is consistent.");
+DEFINE_string(heatmap, "", "Path of the round trip error heatmap image, if wanted.");
+
+
+int main(int argc, char** argv )
+{
+	gflags::SetUsageMessage(USAGE_MESSAGE);
+	gflags::SetVersionString(VERSION);
+
+	gflags::ParseCommandLineFlags(&argc, &argv, true);
+	google::InitGoogleLogging(argv[0]);
+
+	double undistorsion_factors[MODEL_SIZE];
+	cv::Size frame_size;
+	CHECK( read_calibration( FLAGS_input_xml, undistorsion_factors, frame_size ) ) << "can't read " << FLAGS_input_xml;
+
+	UnwrapGrid grid = unwrap_grid( undistorsion_factors, frame_size, FLAGS_unwrap_factor );
+
+	cv::Mat unwrap_map, unwrap_mask;
+	if( FLAGS_input_hdf5.size()>0 )
+	{
+		read_map( FLAGS_input_hdf5, "map", unwrap_map );
+		CVHDFS::read( FLAGS_input_hdf5, "mask", unwrap_mask );
+	}
+	else
+	{
+		CHECK( FLAGS_inverse=="newton" || FLAGS_inverse=="solver" ) << "unknown inverse " << FLAGS_inverse;
+		InverseMethod inverse = FLAGS_inverse=="newton" ? InverseMethod::NEWTON : InverseMethod::SOLVER;
+
+		auto start = std::chrono::steady_clock::now();
+		prepare_unwrap( undistorsion_factors, frame_size, grid, unwrap_map, unwrap_mask, nullptr, inverse );
+		std::cout << "map generated with " << FLAGS_inverse << " in "
+			<< std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() << "s" << std::endl;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	MapVerifyReport report = verify_map( undistorsion_factors, frame_size, grid, unwrap_map, unwrap_mask, FLAGS_tolerance );
+	double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+	std::cout << "map " << unwrap_map.size() << ", " << report.valid_pixels << " of " << report.pixels << " pixels inside the frame, verified in " << seconds << "s" << std::endl;
+	std::cout << std::scientific << std::setprecision( 3 )
+		<< "round trip error: max " << report.max_error << " at " << report.worst
+		<< ", mean " << report.mean_error
+		<< ", median " << report.median_error
+		<< ", 99% " << report.p99_error
+		<< ", 99.9% " << report.p999_error << std::endl;
+	std::cout << "not converged: " << report.non_converged << " pixels, " << report.non_converged_valid << " of them inside the frame" << std::endl;
+	std::cout << "mask: " << report.mask_missing << " pixels inside the frame masked out, " << report.mask_extra << " outside not masked out" << std::endl;
+
+	if( FLAGS_heatmap.size()>0 )
+	{
+		CHECK( cv::imwrite( FLAGS_heatmap, error_heatmap( report.error, FLAGS_max_error ) ) ) << "can't write " << FLAGS_heatmap;
+	}
+
+	bool passed = report.max_error<=FLAGS_max_error && report.mask_missing==0 && report.mask_extra==0;
+	std::cout << ( passed ? "PASS" : "FAIL" ) << std::endl;
+	return passed ? 0 : 1;
+}
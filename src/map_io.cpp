@@ -0,0 +1,329 @@
+#include "map_io.h"
+
+#include "glog/logging.h"
+
+#include "opencvhdfs.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+
+// the hdf5 library is not thread safe in its default build
+static std::mutex hdf5_mutex;
+
+
+void write_map_bands(
+	const std::string &path,
+	const std::string &name,
+	const cv::Mat &map,
+	int band_rows,
+	int deflate_level,
+	bool identity_delta
+)
+{
+	CHECK( map.type()==CV_32FC2 || map.type()==CV_8UC1 ) << "only CV_32FC2 maps and CV_8UC1 masks can be written";
+	CHECK( !identity_delta || map.type()==CV_32FC2 ) << "identity_delta only makes sense for maps";
+	CHECK_GT( band_rows, 0 );
+
+	std::lock_guard<std::mutex> lock( hdf5_mutex );
+
+	hid_t file;
+	if( H5Fis_hdf5( path.c_str() )>0 )
+	{
+		file = H5Fopen( path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT );
+	}
+	else
+	{
+		file = H5Fcreate( path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT );
+	}
+	CHECK_GE( file, 0 ) << "can't open " << path;
+
+	if( H5Lexists( file, name.c_str(), H5P_DEFAULT )>0 )
+	{
+		CHECK_GE( H5Ldelete( file, name.c_str(), H5P_DEFAULT ), 0 );
+	}
+
+	int channels = map.channels();
+	band_rows = std::min( band_rows, map.rows );
+	hsize_t dims[3] = { (hsize_t)map.rows, (hsize_t)map.cols, (hsize_t)channels };
+	hsize_t chunk[3] = { (hsize_t)band_rows, (hsize_t)map.cols, (hsize_t)channels };
+
+	hid_t properties = H5Pcreate( H5P_DATASET_CREATE );
+	H5Pset_chunk( properties, 3, chunk );
+	if( deflate_level>0 )
+	{
+		H5Pset_shuffle( properties );
+		H5Pset_deflate( properties, deflate_level );
+	}
+
+	hid_t type = map.type()==CV_32FC2 ? H5T_NATIVE_FLOAT : H5T_NATIVE_UCHAR;
+	hid_t file_space = H5Screate_simple( 3, dims, NULL );
+	hid_t dataset = H5Dcreate2( file, name.c_str(), type, file_space, H5P_DEFAULT, properties, H5P_DEFAULT );
+	CHECK_GE( dataset, 0 ) << "can't create " << name << " in " << path;
+
+	// written band by band, so the delta never needs a full size copy
+	cv::Mat band;
+	for( int first_row=0; first_row<map.rows; first_row+=band_rows )
+	{
+		int rows = std::min( band_rows, map.rows - first_row );
+		map.rowRange( first_row, first_row+rows ).copyTo( band );
+
+		if( identity_delta )
+		{
+			for( int y=0; y<rows; y++ )
+			{
+				cv::Vec2f *row = band.ptr<cv::Vec2f>( y );
+				for( int x=0; x<band.cols; x++ )
+				{
+					row[x][0] -= x;
+					row[x][1] -= first_row + y;
+				}
+			}
+		}
+
+		hsize_t start[3] = { (hsize_t)first_row, 0, 0 };
+		hsize_t count[3] = { (hsize_t)rows, (hsize_t)map.cols, (hsize_t)channels };
+		H5Sselect_hyperslab( file_space, H5S_SELECT_SET, start, NULL, count, NULL );
+		hid_t memory_space = H5Screate_simple( 3, count, NULL );
+		CHECK_GE( H5Dwrite( dataset, type, memory_space, file_space, H5P_DEFAULT, band.data ), 0 ) << "can't write " << name;
+		H5Sclose( memory_space );
+	}
+
+	if( identity_delta )
+	{
+		int flag = 1;
+		hid_t attribute_space = H5Screate( H5S_SCALAR );
+		hid_t attribute = H5Acreate2( dataset, "identity_delta", H5T_NATIVE_INT, attribute_space, H5P_DEFAULT, H5P_DEFAULT );
+		H5Awrite( attribute, H5T_NATIVE_INT, &flag );
+		H5Aclose( attribute );
+		H5Sclose( attribute_space );
+	}
+
+	H5Dclose( dataset );
+	H5Sclose( file_space );
+	H5Pclose( properties );
+	H5Fclose( file );
+}
+
+
+MapBandReader::MapBandReader( const std::string &path, const std::string &name )
+	: chunk_rows(0), identity_delta(false)
+{
+	std::lock_guard<std::mutex> lock( hdf5_mutex );
+
+	file = H5Fopen( path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT );
+	CHECK_GE( file, 0 ) << "can't open " << path;
+	dataset = H5Dopen2( file, name.c_str(), H5P_DEFAULT );
+	CHECK_GE( dataset, 0 ) << "can't open " << name << " in " << path;
+
+	hid_t space = H5Dget_space( dataset );
+	CHECK_EQ( H5Sget_simple_extent_ndims( space ), 3 ) << name << " is not a map";
+	hsize_t dims[3];
+	H5Sget_simple_extent_dims( space, dims, NULL );
+	CHECK_EQ( dims[2], 2 ) << name << " is not a map";
+	map_size = cv::Size( dims[1], dims[0] );
+	H5Sclose( space );
+
+	hid_t properties = H5Dget_create_plist( dataset );
+	if( H5Pget_layout( properties )==H5D_CHUNKED )
+	{
+		hsize_t chunk[3];
+		H5Pget_chunk( properties, 3, chunk );
+		chunk_rows = chunk[0];
+	}
+	H5Pclose( properties );
+
+	if( H5Aexists( dataset, "identity_delta" )>0 )
+	{
+		int flag = 0;
+		hid_t attribute = H5Aopen( dataset, "identity_delta", H5P_DEFAULT );
+		H5Aread( attribute, H5T_NATIVE_INT, &flag );
+		H5Aclose( attribute );
+		identity_delta = flag!=0;
+	}
+}
+
+MapBandReader::~MapBandReader()
+{
+	std::lock_guard<std::mutex> lock( hdf5_mutex );
+	H5Dclose( dataset );
+	H5Fclose( file );
+}
+
+void MapBandReader::read( int first_row, int rows, cv::Mat &band )
+{
+	CHECK( first_row>=0 && rows>0 && first_row+rows<=map_size.height ) << "band out of the map";
+
+	band.create( rows, map_size.width, CV_32FC2 );
+
+	{
+		std::lock_guard<std::mutex> lock( hdf5_mutex );
+
+		hid_t file_space = H5Dget_space( dataset );
+		hsize_t start[3] = { (hsize_t)first_row, 0, 0 };
+		hsize_t count[3] = { (hsize_t)rows, (hsize_t)map_size.width, 2 };
+		H5Sselect_hyperslab( file_space, H5S_SELECT_SET, start, NULL, count, NULL );
+		hid_t memory_space = H5Screate_simple( 3, count, NULL );
+		CHECK_GE( H5Dread( dataset, H5T_NATIVE_FLOAT, memory_space, file_space, H5P_DEFAULT, band.data ), 0 ) << "can't read map band";
+		H5Sclose( memory_space );
+		H5Sclose( file_space );
+	}
+
+	if( identity_delta )
+	{
+		for( int y=0; y<rows; y++ )
+		{
+			cv::Vec2f *row = band.ptr<cv::Vec2f>( y );
+			for( int x=0; x<band.cols; x++ )
+			{
+				row[x][0] += x;
+				row[x][1] += first_row + y;
+			}
+		}
+	}
+}
+
+
+void write_dataset( const std::string &path, const std::string &name, const cv::Mat &mat )
+{
+	std::lock_guard<std::mutex> lock( hdf5_mutex );
+	CVHDFS::write( path, name, mat );
+}
+
+void read_map( const std::string &path, const std::string &name, cv::Mat &map )
+{
+	MapBandReader reader( path, name );
+	reader.read( 0, reader.size().height, map );
+}
+
+
+void remap_streaming(
+	const cv::Mat &src,
+	cv::Mat &dst,
+	MapBandReader &reader,
+	int strip_rows,
+	int interpolation
+)
+{
+	CHECK_GT( strip_rows, 0 );
+
+	cv::Size size = reader.size();
+	dst.create( size, src.type() );
+
+	cv::Mat band;
+	for( int first_row=0; first_row<size.height; first_row+=strip_rows )
+	{
+		int rows = std::min( strip_rows, size.height - first_row );
+		reader.read( first_row, rows, band );
+
+		cv::Mat strip = dst.rowRange( first_row, first_row+rows );
+		cv::remap( src, strip, band, cv::Mat(), interpolation );
+	}
+}
+
+
+static hid_t open_or_create( const std::string &path )
+{
+	if( H5Fis_hdf5( path.c_str() )>0 )
+	{
+		return H5Fopen( path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT );
+	}
+	return H5Fcreate( path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT );
+}
+
+// replaces the dataset name with a rank 1 or 2 int dataset of data
+static hid_t write_int_dataset( hid_t file, const std::string &name, int rank, const hsize_t *dims, const int *data )
+{
+	if( H5Lexists( file, name.c_str(), H5P_DEFAULT )>0 )
+	{
+		CHECK_GE( H5Ldelete( file, name.c_str(), H5P_DEFAULT ), 0 );
+	}
+	hid_t space = H5Screate_simple( rank, dims, NULL );
+	hid_t dataset = H5Dcreate2( file, name.c_str(), H5T_NATIVE_INT, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT );
+	CHECK_GE( dataset, 0 ) << "can't create " << name;
+	CHECK_GE( H5Dwrite( dataset, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, data ), 0 ) << "can't write " << name;
+	H5Sclose( space );
+	return dataset;
+}
+
+static void write_int_attribute( hid_t dataset, const std::string &name, int value )
+{
+	hid_t space = H5Screate( H5S_SCALAR );
+	hid_t attribute = H5Acreate2( dataset, name.c_str(), H5T_NATIVE_INT, space, H5P_DEFAULT, H5P_DEFAULT );
+	H5Awrite( attribute, H5T_NATIVE_INT, &value );
+	H5Aclose( attribute );
+	H5Sclose( space );
+}
+
+static int read_int_attribute( hid_t dataset, const std::string &name )
+{
+	int value = 0;
+	hid_t attribute = H5Aopen( dataset, name.c_str(), H5P_DEFAULT );
+	CHECK_GE( attribute, 0 ) << "no " << name << " attribute";
+	H5Aread( attribute, H5T_NATIVE_INT, &value );
+	H5Aclose( attribute );
+	return value;
+}
+
+// the number of elements of a dataset
+static hsize_t dataset_size( hid_t dataset )
+{
+	hid_t space = H5Dget_space( dataset );
+	hsize_t size = H5Sget_simple_extent_npoints( space );
+	H5Sclose( space );
+	return size;
+}
+
+
+void write_valid_spans( const std::string &path, const ValidSpans &spans )
+{
+	std::lock_guard<std::mutex> lock( hdf5_mutex );
+
+	hid_t file = open_or_create( path );
+	CHECK_GE( file, 0 ) << "can't open " << path;
+
+	// an empty dataset can't be written from a null pointer, so there is always a dummy span
+	std::vector<cv::Vec2i> data = spans.spans;
+	hsize_t span_dims[2] = { (hsize_t)data.size(), 2 };
+	data.push_back( cv::Vec2i( 0, 0 ) );
+	hid_t dataset = write_int_dataset( file, "spans", 2, span_dims, (const int*)data.data() );
+	write_int_attribute( dataset, "frame_width", spans.frame_size.width );
+	write_int_attribute( dataset, "frame_height", spans.frame_size.height );
+	H5Dclose( dataset );
+
+	hsize_t row_dims[1] = { (hsize_t)spans.row_offsets.size() };
+	H5Dclose( write_int_dataset( file, "span_rows", 1, row_dims, spans.row_offsets.data() ) );
+
+	H5Fclose( file );
+}
+
+bool read_valid_spans( const std::string &path, ValidSpans &spans )
+{
+	std::lock_guard<std::mutex> lock( hdf5_mutex );
+
+	hid_t file = H5Fopen( path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT );
+	CHECK_GE( file, 0 ) << "can't open " << path;
+	if( H5Lexists( file, "spans", H5P_DEFAULT )<=0 || H5Lexists( file, "span_rows", H5P_DEFAULT )<=0 )
+	{
+		H5Fclose( file );
+		return false;
+	}
+
+	hid_t dataset = H5Dopen2( file, "spans", H5P_DEFAULT );
+	spans.frame_size = cv::Size( read_int_attribute( dataset, "frame_width" ), read_int_attribute( dataset, "frame_height" ) );
+	spans.spans.resize( dataset_size( dataset ) / 2 + 1 );
+	CHECK_GE( H5Dread( dataset, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, spans.spans.data() ), 0 ) << "can't read spans";
+	spans.spans.pop_back();
+	H5Dclose( dataset );
+
+	dataset = H5Dopen2( file, "span_rows", H5P_DEFAULT );
+	spans.row_offsets.resize( dataset_size( dataset ) );
+	CHECK_GE( H5Dread( dataset, H5T_NATIVE_INT, H5S_ALL, H5S_ALL, H5P_DEFAULT, spans.row_offsets.data() ), 0 ) << "can't read span_rows";
+	H5Dclose( dataset );
+
+	H5Fclose( file );
+
+	CHECK( !spans.row_offsets.empty() && spans.row_offsets.back()==(int)spans.spans.size() ) << "span index of " << path << " is damaged";
+	return true;
+}
@@ -0,0 +1,217 @@
+#include "map_verify.h"
+#include "undistort_internal.hpp"
+
+#include "glog/logging.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+
+// the smallest error the heatmap tells apart
+static const double HEATMAP_MIN_ERROR = 1e-6;
+
+
+// counts of one row, summed up after the parallel loop so the rows don't share anything
+struct RowCounts {
+	int valid_pixels = 0;
+	int non_converged = 0;
+	int non_converged_valid = 0;
+	int mask_missing = 0;
+	int mask_extra = 0;
+};
+
+class VerifyMapBody : public cv::ParallelLoopBody
+{
+public:
+	VerifyMapBody(
+		const double undistorsion_factors[MODEL_SIZE],
+		cv::Size frame_size,
+		const UnwrapGrid &grid,
+		const cv::Mat &unwrap_map,
+		const cv::Mat &unwrap_mask,
+		double tolerance,
+		cv::Mat &error,
+		std::vector<RowCounts> &counts
+	)
+		: undistorsion_factors(undistorsion_factors), frame_size(frame_size), grid(grid), unwrap_map(unwrap_map),
+		unwrap_mask(unwrap_mask), tolerance(tolerance), error(error), counts(counts) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int y=range.start; y<range.end; y++ )
+		{
+			const cv::Vec2f *row = unwrap_map.ptr<cv::Vec2f>(y);
+			const uchar *mask = unwrap_mask.empty() ? nullptr : unwrap_mask.ptr<uchar>(y);
+			float *row_error = error.ptr<float>(y);
+			RowCounts &count = counts[y];
+
+			for( int x=0; x<unwrap_map.cols; x++ )
+			{
+				double original_x = row[x][0];
+				double original_y = row[x][1];
+
+				bool finite = std::isfinite( original_x ) && std::isfinite( original_y );
+				bool valid = finite
+					&& original_x>=0 && original_x<frame_size.width
+					&& original_y>=0 && original_y<frame_size.height;
+
+				double pixel_error = std::numeric_limits<double>::infinity();
+				if( finite )
+				{
+					double unwrapped_x, unwrapped_y;
+					undistort_internal<double>( original_x, original_y, undistorsion_factors, unwrapped_x, unwrapped_y );
+					pixel_error = std::hypot(
+						unwrapped_x - ( grid.origin.x + x * grid.step.x ),
+						unwrapped_y - ( grid.origin.y + y * grid.step.y )
+					);
+				}
+				row_error[x] = (float)pixel_error;
+
+				if( valid )
+				{
+					count.valid_pixels++;
+				}
+				// NaN compares false too
+				if( !( pixel_error<=tolerance ) )
+				{
+					count.non_converged++;
+					if( valid )
+					{
+						count.non_converged_valid++;
+					}
+				}
+				if( mask!=nullptr )
+				{
+					if( valid && mask[x]==0 )
+					{
+						count.mask_missing++;
+					}
+					else if( !valid && mask[x]!=0 )
+					{
+						count.mask_extra++;
+					}
+				}
+			}
+		}
+	}
+
+private:
+	const double *undistorsion_factors;
+	cv::Size frame_size;
+	const UnwrapGrid &grid;
+	const cv::Mat &unwrap_map;
+	const cv::Mat &unwrap_mask;
+	double tolerance;
+	cv::Mat &error;
+	std::vector<RowCounts> &counts;
+};
+
+
+// the value at fraction of the sorted values, values is reordered
+static double percentile( std::vector<float> &values, double fraction )
+{
+	if( values.empty() )
+	{
+		return 0.0;
+	}
+	size_t idx = std::min( values.size() - 1, (size_t)( fraction * values.size() ) );
+	std::nth_element( values.begin(), values.begin() + idx, values.end() );
+	return values[idx];
+}
+
+
+MapVerifyReport verify_map(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const UnwrapGrid &grid,
+	const cv::Mat &unwrap_map,
+	const cv::Mat &unwrap_mask,
+	double tolerance
+)
+{
+	CHECK_EQ( unwrap_map.type(), CV_32FC2 ) << "unwrap map should be CV_32FC2";
+	CHECK( unwrap_map.size()==grid.size ) << "the map is " << unwrap_map.size() << ", the grid " << grid.size << ", was unwrap_factor the same?";
+	CHECK( unwrap_mask.empty() || ( unwrap_mask.type()==CV_8UC1 && unwrap_mask.size()==unwrap_map.size() ) ) << "mask should be CV_8UC1 of the size of the map";
+
+	MapVerifyReport report;
+	report.pixels = unwrap_map.rows * unwrap_map.cols;
+	report.error.create( unwrap_map.size(), CV_32FC1 );
+
+	std::vector<RowCounts> counts( unwrap_map.rows );
+	cv::parallel_for_( cv::Range( 0, unwrap_map.rows ), VerifyMapBody(
+		undistorsion_factors, frame_size, grid, unwrap_map, unwrap_mask, tolerance, report.error, counts
+	));
+
+	for( const RowCounts &count : counts )
+	{
+		report.valid_pixels += count.valid_pixels;
+		report.non_converged += count.non_converged;
+		report.non_converged_valid += count.non_converged_valid;
+		report.mask_missing += count.mask_missing;
+		report.mask_extra += count.mask_extra;
+	}
+
+	// the statistics of the valid pixels
+	std::vector<float> errors;
+	errors.reserve( report.valid_pixels );
+	double sum = 0.0;
+	for( int y=0; y<unwrap_map.rows; y++ )
+	{
+		const cv::Vec2f *row = unwrap_map.ptr<cv::Vec2f>(y);
+		const float *row_error = report.error.ptr<float>(y);
+		for( int x=0; x<unwrap_map.cols; x++ )
+		{
+			if( !( row[x][0]>=0 && row[x][0]<frame_size.width && row[x][1]>=0 && row[x][1]<frame_size.height ) )
+			{
+				continue;
+			}
+			if( errors.empty() || row_error[x]>report.max_error )
+			{
+				report.max_error = row_error[x];
+				report.worst = cv::Point( x, y );
+			}
+			errors.push_back( row_error[x] );
+			sum += row_error[x];
+		}
+	}
+	if( !errors.empty() )
+	{
+		report.mean_error = sum / errors.size();
+		report.median_error = percentile( errors, 0.5 );
+		report.p99_error = percentile( errors, 0.99 );
+		report.p999_error = percentile( errors, 0.999 );
+	}
+
+	return report;
+}
+
+
+cv::Mat error_heatmap( const cv::Mat &error, double max_error )
+{
+	CHECK_EQ( error.type(), CV_32FC1 ) << "error should be CV_32FC1";
+
+	double low = std::log10( HEATMAP_MIN_ERROR );
+	double high = std::log10( std::max( max_error, HEATMAP_MIN_ERROR * 10.0 ) );
+
+	cv::Mat scaled( error.size(), CV_8UC1 );
+	cv::Mat non_finite( error.size(), CV_8UC1 );
+	for( int y=0; y<error.rows; y++ )
+	{
+		const float *row = error.ptr<float>(y);
+		uchar *out = scaled.ptr<uchar>(y);
+		uchar *bad = non_finite.ptr<uchar>(y);
+		for( int x=0; x<error.cols; x++ )
+		{
+			bad[x] = std::isfinite( row[x] ) ? 0 : 255;
+			double level = ( std::log10( std::max( (double)row[x], HEATMAP_MIN_ERROR ) ) - low ) / ( high - low );
+			out[x] = bad[x] ? 255 : cv::saturate_cast<uchar>( 255.0 * level );
+		}
+	}
+
+	cv::Mat heatmap;
+	cv::applyColorMap( scaled, heatmap, cv::COLORMAP_JET );
+	heatmap.setTo( cv::Scalar( 255, 255, 255 ), non_finite );
+	return heatmap;
+}
@@ -6,6 +6,7 @@
 
 #include <limits>
 #include <algorithm>
+#include <atomic>
 
 
 double interpolate( double a, double b, double factor )
@@ -14,12 +15,10 @@ double interpolate( double a, double b, double factor )
 }
 
 
-void prepare_unwrap(
+cv::Rect2d unwrap_rectangle(
 	const double undistorsion_factors[MODEL_SIZE],
 	cv::Size frame_size,
-	double unwrap_factor,
-	cv::Mat &unwrap_map,
-	cv::Mat &unwrap_mask
+	double unwrap_factor
 )
 {
 	CHECK( std::numeric_limits<double>::has_infinity ) << "double doesn't have infinity on this system? wow!";
@@ -74,9 +73,6 @@ void prepare_unwrap(
 	double unwrapped_bottom = interpolate( max_bottom, min_bottom, unwrap_factor );
 	double unwrapped_left = interpolate( max_left, min_left, unwrap_factor );
 	double unwrapped_right = interpolate( max_right, min_right, unwrap_factor );
-	int unwrapped_width = (int)( unwrapped_right - unwrapped_left );
-	int unwrapped_height = (int)( unwrapped_bottom - unwrapped_top );
-
 
 	/*
 	std::cout << "min rectangle" << std::endl;
@@ -104,166 +100,285 @@ void prepare_unwrap(
 	std::cout << "    bottom:" << unwrapped_bottom << std::endl;
 	std::cout << "    left:" << unwrapped_left << std::endl;
 	std::cout << "    right:" << unwrapped_right << std::endl;
-	std::cout << "    width:" << unwrapped_width << std::endl;
-	std::cout << "    height:" << unwrapped_height << std::endl << std::endl;
+	std::cout << "    width:" << (unwrapped_right-unwrapped_left) << std::endl;
+	std::cout << "    height:" << (unwrapped_bottom-unwrapped_top) << std::endl << std::endl;
 	*/
 
-	// ensuring output matrixes has the correct type and size
-	unwrap_map.create( unwrapped_height, unwrapped_width, CV_32FC2 );
-	unwrap_mask.create( unwrapped_height, unwrapped_width, CV_8UC1 );
+	return cv::Rect2d(
+		unwrapped_left,
+		unwrapped_top,
+		unwrapped_right - unwrapped_left,
+		unwrapped_bottom - unwrapped_top
+	);
+}
 
-	int next_percentage_to_report = 5;
-	int report_every = 5;
 
-	for(int x=0; x<unwrapped_width; x++ )
+/*
+	Fills rows of the already allocated unwrap_map and unwrap_mask. Output pixel (x,y) shows the unwrapped point
+	origin + (x*step.x, y*step.y), or origin + rectification_map(x,y) if there is a rectification_map.
+	If there is an initial_map, pixel (x,y) starts from its pixel (x,y) + initial_offset, clamped. initial_map
+	may be unwrap_map itself if the offset is zero, every pixel is read before it is overwritten.
+	Rows are independent, so they are filled in parallel. Cancellation is checked before every row.
+*/
+class FillUnwrapMapBody : public cv::ParallelLoopBody
+{
+public:
+	FillUnwrapMapBody(
+		const double undistorsion_factors[MODEL_SIZE],
+		cv::Size frame_size,
+		cv::Point2d origin,
+		cv::Point2d step,
+		const cv::Mat &rectification_map,
+		const cv::Mat &initial_map,
+		cv::Point initial_offset,
+		InverseMethod inverse,
+		cv::Mat &unwrap_map,
+		cv::Mat &unwrap_mask,
+		const ProgressReporter &reporter,
+		std::atomic<int> &rows_done,
+		std::atomic<bool> &cancelled
+	)
+		: undistorsion_factors(undistorsion_factors), frame_size(frame_size), origin(origin), step(step),
+		rectification_map(rectification_map), initial_map(initial_map), initial_offset(initial_offset),
+		inverse(inverse), unwrap_map(unwrap_map), unwrap_mask(unwrap_mask),
+		reporter(reporter), rows_done(rows_done), cancelled(cancelled) {}
+
+	void operator()( const cv::Range &range ) const
 	{
-		for(int y=0; y<unwrapped_height; y++ )
+		for(int y=range.start; y<range.end; y++ )
 		{
-			cv::Point2d unwrapped_point(
-				x + unwrapped_left,
-				y + unwrapped_top
-			);
-
-			cv::Point2d original_point = distort(undistorsion_factors, unwrapped_point );
-			unwrap_map.at<cv::Vec2f>( y, x ) = cv::Vec2f(
-				original_point.x,
-				original_point.y
-			);
-
-			bool valid = 
-				original_point.x>=0 && original_point.x<frame_size.width
-				&& original_point.y>=0 && original_point.x<frame_size.height;
-
-			if( valid )
+			if( cancelled || reporter.cancelled() )
 			{
-				unwrap_mask.at<uchar>( y, x ) = 255.;
+				cancelled = true;
+				return;
 			}
-			else
+
+			for(int x=0; x<unwrap_map.cols; x++ )
 			{
-				unwrap_mask.at<uchar>( y, x ) = 0.;
+				cv::Point2d unwrapped_point( x * step.x, y * step.y );
+				if( !rectification_map.empty() )
+				{
+					cv::Vec2f rectification_pix = rectification_map.at<cv::Vec2f>(y,x);
+					unwrapped_point = cv::Point2d( rectification_pix[0], rectification_pix[1] );
+				}
+				unwrapped_point += origin;
+
+				cv::Point2d original_point;
+				if( !initial_map.empty() )
+				{
+					cv::Vec2f initial = initial_map.at<cv::Vec2f>(
+						std::min( std::max( y + initial_offset.y, 0 ), initial_map.rows - 1 ),
+						std::min( std::max( x + initial_offset.x, 0 ), initial_map.cols - 1 )
+					);
+					cv::Point2d initial_guess( initial[0], initial[1] );
+					original_point = inverse==InverseMethod::NEWTON
+						? distort_newton(undistorsion_factors, unwrapped_point, initial_guess )
+						: distort(undistorsion_factors, unwrapped_point, initial_guess );
+				}
+				else
+				{
+					original_point = inverse==InverseMethod::NEWTON
+						? distort_newton(undistorsion_factors, unwrapped_point )
+						: distort(undistorsion_factors, unwrapped_point );
+				}
+				unwrap_map.at<cv::Vec2f>( y, x ) = cv::Vec2f(
+					original_point.x,
+					original_point.y
+				);
+
+				bool valid = 
+					original_point.x>=0 && original_point.x<frame_size.width
+					&& original_point.y>=0 && original_point.y<frame_size.height;
+
+				if( valid )
+				{
+					unwrap_mask.at<uchar>( y, x ) = 255.;
+				}
+				else
+				{
+					unwrap_mask.at<uchar>( y, x ) = 0.;
+				}
 			}
-		}
 
-		double percentage = (double)x / (double)unwrapped_width;
-		if( percentage*100 >= next_percentage_to_report )
-		{
-			std::cout << next_percentage_to_report << "%" << std::endl;
-			next_percentage_to_report += report_every;
-		} 
+			reporter.report( (double)(++rows_done) / (double)unwrap_map.rows );
+		}
 	}
 
+private:
+	const double *undistorsion_factors;
+	cv::Size frame_size;
+	cv::Point2d origin;
+	cv::Point2d step;
+	const cv::Mat &rectification_map;
+	const cv::Mat &initial_map;
+	cv::Point initial_offset;
+	InverseMethod inverse;
+	cv::Mat &unwrap_map;
+	cv::Mat &unwrap_mask;
+	const ProgressReporter &reporter;
+	std::atomic<int> &rows_done;
+	std::atomic<bool> &cancelled;
+};
+
+// returns false if cancelled
+bool fill_unwrap_map(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	cv::Point2d origin,
+	cv::Point2d step,
+	const cv::Mat &rectification_map,
+	InverseMethod inverse,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressReporter &reporter,
+	const cv::Mat &initial_map = cv::Mat(),
+	cv::Point initial_offset = cv::Point()
+)
+{
+	std::atomic<int> rows_done( 0 );
+	std::atomic<bool> cancelled( false );
+
+	cv::parallel_for_( cv::Range( 0, unwrap_map.rows ), FillUnwrapMapBody(
+		undistorsion_factors, frame_size, origin, step, rectification_map, initial_map, initial_offset, inverse,
+		unwrap_map, unwrap_mask, reporter, rows_done, cancelled
+	));
+
+	return !cancelled;
 }
 
 
+UnwrapGrid unwrap_grid(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	double unwrap_factor,
+	cv::Rect2d roi,
+	cv::Size output_size
+)
+{
+	cv::Rect2d unwrapped_rectangle = unwrap_rectangle( undistorsion_factors, frame_size, unwrap_factor );
+	cv::Size unwrapped_size( (int)( unwrapped_rectangle.width ), (int)( unwrapped_rectangle.height ) );
+
+	if( roi.area()<=0 )
+	{
+		roi = cv::Rect2d( 0, 0, unwrapped_size.width, unwrapped_size.height );
+	}
+	if( output_size.area()<=0 )
+	{
+		output_size = cv::Size( (int)roi.width, (int)roi.height );
+	}
+
+	// the output pixel centers are spread evenly over roi, the same way cv::resize does it.
+	// without scaling or cropping this is the identity, output pixel (x,y) is unwrapped pixel (x,y)
+	UnwrapGrid grid;
+	grid.size = output_size;
+	grid.step = cv::Point2d( roi.width / output_size.width, roi.height / output_size.height );
+	grid.origin = unwrapped_rectangle.tl() + roi.tl() + ( grid.step - cv::Point2d( 1.0, 1.0 ) ) * 0.5;
+	return grid;
+}
+
 
-void concatenate_rectification_map_and_unwrap(
+bool prepare_unwrap(
 	const double undistorsion_factors[MODEL_SIZE],
-	cv::Mat &rectification_map,
 	cv::Size frame_size,
 	double unwrap_factor,
 	cv::Mat &unwrap_map,
-	cv::Mat &unwrap_mask
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context,
+	InverseMethod inverse
 )
 {
-	CHECK( std::numeric_limits<double>::has_infinity ) << "double doesn't have infinity on this system? wow!";
+	UnwrapGrid grid = unwrap_grid( undistorsion_factors, frame_size, unwrap_factor );
+	return prepare_unwrap( undistorsion_factors, frame_size, grid, unwrap_map, unwrap_mask, context, inverse );
+}
 
 
-	cv::Point2d original_center(undistorsion_factors[0], undistorsion_factors[1]);
-	cv::Point2d undistorted_center = undistort(undistorsion_factors, original_center );
+bool prepare_unwrap(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const UnwrapGrid &grid,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context,
+	InverseMethod inverse
+)
+{
+	// ensuring output matrixes has the correct type and size
+	unwrap_map.create( grid.size, CV_32FC2 );
+	unwrap_mask.create( grid.size, CV_8UC1 );
 
-	// first calculate the min and max rectangle
-	// min is the rectangle where all the pixels are valid.
-	// max is the rectangle where all the input pixels has been unwrapped. some pixels will be thus invalid
-	double min_top = -1. * std::numeric_limits<double>::infinity();
-	double min_bottom = std::numeric_limits<double>::infinity();
-	double min_left = -1. * std::numeric_limits<double>::infinity();
-	double min_right = std::numeric_limits<double>::infinity();
+	ProgressReporter reporter( context, "unwrap" );
+	return fill_unwrap_map( undistorsion_factors, frame_size, grid.origin, grid.step, cv::Mat(), inverse, unwrap_map, unwrap_mask, reporter );
+}
 
-	double max_top = undistorted_center.y;
-	double max_bottom = undistorted_center.y;
-	double max_left = undistorted_center.x;
-	double max_right = undistorted_center.x;
 
-	for(int x=0; x<=frame_size.width; x++)
-	{
-		cv::Point2d edge_point =  undistort(undistorsion_factors, cv::Point2d( x, 0.0 ) );
-		min_top = std::max( min_top, edge_point.y );
-		max_top = std::min( max_top, edge_point.y );
+bool update_unwrap(
+	const double previous_factors[MODEL_SIZE],
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	double unwrap_factor,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context,
+	InverseMethod inverse
+)
+{
+	// only the border of the frame is undistorted for these, no need to keep them
+	UnwrapGrid previous_grid = unwrap_grid( previous_factors, frame_size, unwrap_factor );
+	UnwrapGrid grid = unwrap_grid( undistorsion_factors, frame_size, unwrap_factor );
+	return update_unwrap( previous_grid, undistorsion_factors, frame_size, grid, unwrap_map, unwrap_mask, context, inverse );
+}
 
-		edge_point =  undistort(undistorsion_factors, cv::Point2d( x, frame_size.height ) );
-		min_bottom = std::min( min_bottom, edge_point.y );
-		max_bottom = std::max( max_bottom, edge_point.y );
-	}
+bool update_unwrap(
+	const UnwrapGrid &previous_grid,
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	const UnwrapGrid &grid,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context,
+	InverseMethod inverse
+)
+{
+	CHECK( unwrap_map.type()==CV_32FC2 && unwrap_map.size()==previous_grid.size ) << "unwrap_map should be the map of previous_grid";
 
-	for(int y=0; y<=frame_size.height; y++)
-	{
-		cv::Point2d edge_point =  undistort(undistorsion_factors, cv::Point2d( 0.0, y ) );
-		min_left = std::max( min_left, edge_point.x );
-		max_left = std::min( max_left, edge_point.x );
+	// the previous pixel showing the same unwrapped point, the grid moves with the unwrap rectangle
+	cv::Point2d shift = grid.origin - previous_grid.origin;
+	cv::Point initial_offset( cvRound( shift.x / previous_grid.step.x ), cvRound( shift.y / previous_grid.step.y ) );
 
-		edge_point =  undistort(undistorsion_factors, cv::Point2d( frame_size.width, y ) );
-		min_right= std::min( min_right, edge_point.x );
-		max_right = std::max( max_right, edge_point.x );
-	}
+	ProgressReporter reporter( context, "unwrap update" );
 
-	// safety check on unwrap_factor, don't want to terminate just because it's out of bounds, but don't want to be silent about it either
-	if( unwrap_factor<0 || unwrap_factor>1.0 )
+	if( grid.size==previous_grid.size && initial_offset==cv::Point() )
 	{
-		std::cerr << "unwrap_factor is out of bounds. will be clipped" << std::endl;
-		unwrap_factor = std::min( 1.0, std::max( 0.0, unwrap_factor ));
+		// every pixel starts from its own previous value, so it is done in place
+		unwrap_mask.create( grid.size, CV_8UC1 );
+		return fill_unwrap_map( undistorsion_factors, frame_size, grid.origin, grid.step, cv::Mat(), inverse, unwrap_map, unwrap_mask, reporter, unwrap_map, initial_offset );
 	}
 
-	// calculate result rectangle (interpolation between min and max rectangles by unwrap_factor )
-	double unwrapped_top = interpolate( max_top, min_top, unwrap_factor );
-	double unwrapped_bottom = interpolate( max_bottom, min_bottom, unwrap_factor );
-	double unwrapped_left = interpolate( max_left, min_left, unwrap_factor );
-	double unwrapped_right = interpolate( max_right, min_right, unwrap_factor );
+	cv::Mat initial_map = unwrap_map.clone();
+	unwrap_map.create( grid.size, CV_32FC2 );
+	unwrap_mask.create( grid.size, CV_8UC1 );
+	return fill_unwrap_map( undistorsion_factors, frame_size, grid.origin, grid.step, cv::Mat(), inverse, unwrap_map, unwrap_mask, reporter, initial_map, initial_offset );
+}
+
+
+bool concatenate_rectification_map_and_unwrap(
+	const double undistorsion_factors[MODEL_SIZE],
+	const cv::Mat &rectification_map,
+	cv::Size frame_size,
+	double unwrap_factor,
+	cv::Mat &unwrap_map,
+	cv::Mat &unwrap_mask,
+	const ProgressContext *context,
+	InverseMethod inverse
+)
+{
+	cv::Rect2d unwrapped_rectangle = unwrap_rectangle( undistorsion_factors, frame_size, unwrap_factor );
 
 	// ensuring output matrixes has the correct type and size
 	cv::Size rectification_size = rectification_map.size();
 	unwrap_map.create( rectification_size.height, rectification_size.width, CV_32FC2 );
 	unwrap_mask.create( rectification_size.height, rectification_size.width, CV_8UC1 );
 
-	int next_percentage_to_report = 5;
-	int report_every = 5;
-
-	for(int x=0; x<rectification_size.width; x++ )
-	{
-		for(int y=0; y<rectification_size.height; y++ )
-		{
-			cv::Vec2f rectification_pix = rectification_map.at<cv::Vec2f>(y,x);
-
-			cv::Point2d unwrapped_point(
-				rectification_pix[0] + unwrapped_left,
-				rectification_pix[1] + unwrapped_top
-			);
-
-			cv::Point2d original_point = distort(undistorsion_factors, unwrapped_point );
-			unwrap_map.at<cv::Vec2f>( y, x ) = cv::Vec2f(
-				original_point.x,
-				original_point.y
-			);
-
-			bool valid = 
-				original_point.x>=0 && original_point.x<frame_size.width
-				&& original_point.y>=0 && original_point.x<frame_size.height;
-
-			if( valid )
-			{
-				unwrap_mask.at<uchar>( y, x ) = 255.;
-			}
-			else
-			{
-				unwrap_mask.at<uchar>( y, x ) = 0.;
-			}
-		}
-
-		double percentage = (double)x / (double)rectification_size.width;
-		if( percentage*100 >= next_percentage_to_report )
-		{
-			std::cout << next_percentage_to_report << "%" << std::endl;
-			next_percentage_to_report += report_every;
-		} 
-	}
-
-}
\ No newline at end of file
+	ProgressReporter reporter( context, "rectification unwrap" );
+	return fill_unwrap_map( undistorsion_factors, frame_size, unwrapped_rectangle.tl(), cv::Point2d( 1.0, 1.0 ), rectification_map, inverse, unwrap_map, unwrap_mask, reporter );
+}
@@ -0,0 +1,77 @@
+#include "progress.h"
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+
+ProgressReporter::ProgressReporter( const ProgressContext *context, const std::string &stage )
+	: context(context), stage(stage), start(std::chrono::steady_clock::now())
+{
+}
+
+void ProgressReporter::report( double fraction ) const
+{
+	if( context==nullptr || !context->progress )
+	{
+		return;
+	}
+
+	double eta_seconds = -1.0;
+	if( fraction>0.0 )
+	{
+		double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		eta_seconds = elapsed * (1.0 - fraction) / fraction;
+	}
+	context->progress( stage, fraction, eta_seconds );
+}
+
+bool ProgressReporter::cancelled() const
+{
+	return context!=nullptr && context->cancellation!=nullptr && context->cancellation->is_cancelled();
+}
+
+bool ProgressReporter::verbose() const
+{
+	return context!=nullptr && context->verbose;
+}
+
+
+ProgressContext console_progress( bool verbose )
+{
+	struct State {
+		std::mutex mutex;
+		std::string stage;
+		int next_percentage_to_report;
+	};
+	std::shared_ptr<State> state = std::make_shared<State>();
+
+	ProgressContext context;
+	context.verbose = verbose;
+	context.progress = [state]( const std::string &stage, double fraction, double eta_seconds ) {
+		const int report_every = 5;
+
+		std::lock_guard<std::mutex> lock( state->mutex );
+		if( stage!=state->stage )
+		{
+			state->stage = stage;
+			state->next_percentage_to_report = report_every;
+		}
+
+		if( fraction*100 >= state->next_percentage_to_report )
+		{
+			std::cout << stage << " " << state->next_percentage_to_report << "%";
+			if( eta_seconds>=0.0 )
+			{
+				std::cout << ", about " << (int)eta_seconds << "s left";
+			}
+			std::cout << std::endl;
+
+			while( fraction*100 >= state->next_percentage_to_report )
+			{
+				state->next_percentage_to_report += report_every;
+			}
+		}
+	};
+	return context;
+}
@@ -0,0 +1,442 @@
+/*
+	Python bindings for the library part of lens_undistort.
+
+	Arrays are passed through the buffer protocol, so numpy arrays (or anything exposing a
+	C contiguous buffer) are used in place, without copies. Outputs are written into buffers
+	preallocated by the caller, use unwrap_size to find out how big the map will be.
+	The GIL is released while the heavy lifting runs, so python threads can work in parallel.
+*/
+#include <Python.h>
+
+#include <limits.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "lines.h"
+#include "undistort.h"
+
+
+// a buffer borrowed from a python object, viewed as a cv::Mat. the buffer is released with the view
+class BufferMat
+{
+public:
+	BufferMat() : acquired(false) {}
+
+	~BufferMat()
+	{
+		if( acquired )
+		{
+			PyBuffer_Release( &view );
+		}
+	}
+
+	// expects a C contiguous 2d (single channel) or 3d (multi channel) buffer of format
+	bool acquire( PyObject *obj, char format, bool writable, const char *name )
+	{
+		int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+		if( writable )
+		{
+			flags |= PyBUF_WRITABLE;
+		}
+		if( PyObject_GetBuffer( obj, &view, flags )!=0 )
+		{
+			return false;
+		}
+		acquired = true;
+
+		if( view.format==NULL || view.format[0]!=format || view.format[1]!='\0' )
+		{
+			PyErr_Format( PyExc_TypeError, "%s: expected buffer of format '%c', got '%s'", name, format, view.format ? view.format : "B" );
+			return false;
+		}
+		if( view.ndim!=2 && view.ndim!=3 )
+		{
+			PyErr_Format( PyExc_ValueError, "%s: expected 2 or 3 dimensions, got %d", name, view.ndim );
+			return false;
+		}
+
+		int depth = format=='B' ? CV_8U : format=='f' ? CV_32F : CV_64F;
+		int channels = view.ndim==3 ? (int)view.shape[2] : 1;
+		mat = cv::Mat( (int)view.shape[0], (int)view.shape[1], CV_MAKETYPE(depth, channels), view.buf );
+		return true;
+	}
+
+	cv::Mat mat;
+
+private:
+	Py_buffer view;
+	bool acquired;
+};
+
+
+bool parse_factors( PyObject *obj, double undistorsion_factors[MODEL_SIZE] )
+{
+	PyObject *seq = PySequence_Fast( obj, "undistorsion factors should be a sequence of cx, cy, k1, k2" );
+	if( seq==NULL )
+	{
+		return false;
+	}
+	bool ok = PySequence_Fast_GET_SIZE( seq )==MODEL_SIZE;
+	for( int i=0; ok && i<MODEL_SIZE; i++ )
+	{
+		undistorsion_factors[i] = PyFloat_AsDouble( PySequence_Fast_GET_ITEM( seq, i ) );
+		ok = !PyErr_Occurred();
+	}
+	Py_DECREF( seq );
+	if( !ok && !PyErr_Occurred() )
+	{
+		PyErr_SetString( PyExc_ValueError, "undistorsion factors should be a sequence of cx, cy, k1, k2" );
+	}
+	return ok;
+}
+
+// a point is any sequence of two ints: a tuple, a list, a row of an (N, 2) int array
+bool parse_point( PyObject *obj, cv::Point &point )
+{
+	PyObject *seq = PySequence_Fast( obj, "a point should be a sequence of x, y" );
+	if( seq==NULL )
+	{
+		return false;
+	}
+	bool ok = PySequence_Fast_GET_SIZE( seq )==2;
+	long coordinates[2];
+	for( int i=0; ok && i<2; i++ )
+	{
+		coordinates[i] = PyLong_AsLong( PySequence_Fast_GET_ITEM( seq, i ) );
+		ok = !PyErr_Occurred();
+		if( ok && ( coordinates[i]<INT_MIN || coordinates[i]>INT_MAX ) )
+		{
+			PyErr_SetString( PyExc_OverflowError, "a point coordinate doesn't fit an int" );
+			ok = false;
+		}
+	}
+	Py_DECREF( seq );
+	if( !ok && !PyErr_Occurred() )
+	{
+		PyErr_SetString( PyExc_ValueError, "a point should be a sequence of x, y" );
+	}
+	if( ok )
+	{
+		point = cv::Point( (int)coordinates[0], (int)coordinates[1] );
+	}
+	return ok;
+}
+
+bool parse_lines( PyObject *obj, Lines &lines )
+{
+	PyObject *lines_seq = PySequence_Fast( obj, "lines should be a sequence of lines" );
+	if( lines_seq==NULL )
+	{
+		return false;
+	}
+	bool ok = true;
+	for( Py_ssize_t line_idx=0; ok && line_idx<PySequence_Fast_GET_SIZE( lines_seq ); line_idx++ )
+	{
+		PyObject *line_seq = PySequence_Fast( PySequence_Fast_GET_ITEM( lines_seq, line_idx ), "a line should be a sequence of x, y points" );
+		if( line_seq==NULL )
+		{
+			ok = false;
+			break;
+		}
+		Line line;
+		for( Py_ssize_t point_idx=0; ok && point_idx<PySequence_Fast_GET_SIZE( line_seq ); point_idx++ )
+		{
+			cv::Point point;
+			ok = parse_point( PySequence_Fast_GET_ITEM( line_seq, point_idx ), point );
+			line.push_back( point );
+		}
+		Py_DECREF( line_seq );
+		lines.push_back( line );
+	}
+	Py_DECREF( lines_seq );
+	return ok;
+}
+
+bool check_size( const cv::Mat &mat, cv::Size size, int channels, const char *name )
+{
+	if( mat.size()!=size || mat.channels()!=channels )
+	{
+		PyErr_Format( PyExc_ValueError, "%s: expected shape (%d, %d, %d), got (%d, %d, %d)", name,
+			size.height, size.width, channels, mat.rows, mat.cols, mat.channels() );
+		return false;
+	}
+	return true;
+}
+
+
+static PyObject* py_extract_lines( PyObject *self, PyObject *args )
+{
+	PyObject *frame_obj;
+	if( !PyArg_ParseTuple( args, "O", &frame_obj ) )
+	{
+		return NULL;
+	}
+	BufferMat frame;
+	if( !frame.acquire( frame_obj, 'B', false, "frame" ) )
+	{
+		return NULL;
+	}
+	if( frame.mat.channels()!=3 )
+	{
+		PyErr_SetString( PyExc_ValueError, "frame: expected a 3 channel image" );
+		return NULL;
+	}
+
+	Lines lines;
+	Py_BEGIN_ALLOW_THREADS
+	extract_lines( frame.mat, lines );
+	Py_END_ALLOW_THREADS
+
+	PyObject *result = PyList_New( lines.size() );
+	for( size_t line_idx=0; line_idx<lines.size(); line_idx++ )
+	{
+		const Line &line = lines[line_idx];
+		PyObject *py_line = PyList_New( line.size() );
+		for( size_t point_idx=0; point_idx<line.size(); point_idx++ )
+		{
+			PyList_SET_ITEM( py_line, point_idx, Py_BuildValue( "(ii)", line[point_idx].x, line[point_idx].y ) );
+		}
+		PyList_SET_ITEM( result, line_idx, py_line );
+	}
+	return result;
+}
+
+static PyObject* py_fitUndistorsionModel( PyObject *self, PyObject *args )
+{
+	PyObject *lines_obj;
+	int width, height;
+	if( !PyArg_ParseTuple( args, "O(ii)", &lines_obj, &width, &height ) )
+	{
+		return NULL;
+	}
+	Lines lines;
+	if( !parse_lines( lines_obj, lines ) )
+	{
+		return NULL;
+	}
+
+	double undistorsion_factors[MODEL_SIZE];
+	Py_BEGIN_ALLOW_THREADS
+	fitUndistorsionModel( lines, undistorsion_factors, cv::Size( width, height ) );
+	Py_END_ALLOW_THREADS
+
+	return Py_BuildValue( "(dddd)", undistorsion_factors[0], undistorsion_factors[1], undistorsion_factors[2], undistorsion_factors[3] );
+}
+
+static PyObject* py_unwrap_size( PyObject *self, PyObject *args )
+{
+	PyObject *factors_obj;
+	int width, height;
+	double unwrap_factor;
+	if( !PyArg_ParseTuple( args, "O(ii)d", &factors_obj, &width, &height, &unwrap_factor ) )
+	{
+		return NULL;
+	}
+	double undistorsion_factors[MODEL_SIZE];
+	if( !parse_factors( factors_obj, undistorsion_factors ) )
+	{
+		return NULL;
+	}
+
+	cv::Rect2d rectangle = unwrap_rectangle( undistorsion_factors, cv::Size( width, height ), unwrap_factor );
+	return Py_BuildValue( "(ii)", (int)rectangle.width, (int)rectangle.height );
+}
+
+static PyObject* py_prepare_unwrap( PyObject *self, PyObject *args )
+{
+	PyObject *factors_obj, *map_obj, *mask_obj;
+	int width, height;
+	double unwrap_factor;
+	if( !PyArg_ParseTuple( args, "O(ii)dOO", &factors_obj, &width, &height, &unwrap_factor, &map_obj, &mask_obj ) )
+	{
+		return NULL;
+	}
+	double undistorsion_factors[MODEL_SIZE];
+	BufferMat unwrap_map, unwrap_mask;
+	if( !parse_factors( factors_obj, undistorsion_factors )
+		|| !unwrap_map.acquire( map_obj, 'f', true, "unwrap_map" )
+		|| !unwrap_mask.acquire( mask_obj, 'B', true, "unwrap_mask" ) )
+	{
+		return NULL;
+	}
+
+	// the outputs have to be exactly the right size, otherwise prepare_unwrap would reallocate them
+	cv::Rect2d rectangle = unwrap_rectangle( undistorsion_factors, cv::Size( width, height ), unwrap_factor );
+	cv::Size unwrapped_size( (int)rectangle.width, (int)rectangle.height );
+	if( !check_size( unwrap_map.mat, unwrapped_size, 2, "unwrap_map" ) || !check_size( unwrap_mask.mat, unwrapped_size, 1, "unwrap_mask" ) )
+	{
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	prepare_unwrap( undistorsion_factors, cv::Size( width, height ), unwrap_factor, unwrap_map.mat, unwrap_mask.mat );
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+static PyObject* py_update_unwrap( PyObject *self, PyObject *args )
+{
+	PyObject *previous_obj, *factors_obj, *map_obj, *mask_obj;
+	int width, height;
+	double unwrap_factor;
+	if( !PyArg_ParseTuple( args, "OO(ii)dOO", &previous_obj, &factors_obj, &width, &height, &unwrap_factor, &map_obj, &mask_obj ) )
+	{
+		return NULL;
+	}
+	double previous_factors[MODEL_SIZE], undistorsion_factors[MODEL_SIZE];
+	BufferMat unwrap_map, unwrap_mask;
+	if( !parse_factors( previous_obj, previous_factors )
+		|| !parse_factors( factors_obj, undistorsion_factors )
+		|| !unwrap_map.acquire( map_obj, 'f', true, "unwrap_map" )
+		|| !unwrap_mask.acquire( mask_obj, 'B', true, "unwrap_mask" ) )
+	{
+		return NULL;
+	}
+
+	// the buffers are updated in place, so the size can't change
+	cv::Size frame_size( width, height );
+	UnwrapGrid previous_grid = unwrap_grid( previous_factors, frame_size, unwrap_factor );
+	UnwrapGrid grid = unwrap_grid( undistorsion_factors, frame_size, unwrap_factor );
+	if( previous_grid.size!=grid.size )
+	{
+		PyErr_SetString( PyExc_ValueError, "the unwrapped size changed, use prepare_unwrap with new buffers" );
+		return NULL;
+	}
+	if( !check_size( unwrap_map.mat, grid.size, 2, "unwrap_map" ) || !check_size( unwrap_mask.mat, grid.size, 1, "unwrap_mask" ) )
+	{
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	update_unwrap( previous_grid, undistorsion_factors, frame_size, grid, unwrap_map.mat, unwrap_mask.mat );
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+// shared by undistort_points and distort_points. points and out are (N, 2) float64, out may be points
+static PyObject* transform_points( PyObject *args, cv::Point2d (*transform)(const double[MODEL_SIZE], cv::Point2d) )
+{
+	PyObject *factors_obj, *points_obj, *out_obj;
+	if( !PyArg_ParseTuple( args, "OOO", &factors_obj, &points_obj, &out_obj ) )
+	{
+		return NULL;
+	}
+	double undistorsion_factors[MODEL_SIZE];
+	BufferMat points, out;
+	if( !parse_factors( factors_obj, undistorsion_factors )
+		|| !points.acquire( points_obj, 'd', false, "points" )
+		|| !out.acquire( out_obj, 'd', true, "out" ) )
+	{
+		return NULL;
+	}
+	if( points.mat.cols!=2 || points.mat.channels()!=1 )
+	{
+		PyErr_SetString( PyExc_ValueError, "points: expected shape (N, 2)" );
+		return NULL;
+	}
+	if( !check_size( out.mat, points.mat.size(), 1, "out" ) )
+	{
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	for( int idx=0; idx<points.mat.rows; idx++ )
+	{
+		const double *point = points.mat.ptr<double>( idx );
+		cv::Point2d transformed = transform( undistorsion_factors, cv::Point2d( point[0], point[1] ) );
+		double *out_point = out.mat.ptr<double>( idx );
+		out_point[0] = transformed.x;
+		out_point[1] = transformed.y;
+	}
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+static PyObject* py_undistort_points( PyObject *self, PyObject *args )
+{
+	return transform_points( args, undistort );
+}
+
+static PyObject* py_distort_points( PyObject *self, PyObject *args )
+{
+	return transform_points( args, distort );
+}
+
+static PyObject* py_remap( PyObject *self, PyObject *args )
+{
+	PyObject *src_obj, *map_obj, *dst_obj;
+	if( !PyArg_ParseTuple( args, "OOO", &src_obj, &map_obj, &dst_obj ) )
+	{
+		return NULL;
+	}
+	BufferMat src, unwrap_map, dst;
+	if( !src.acquire( src_obj, 'B', false, "src" )
+		|| !unwrap_map.acquire( map_obj, 'f', false, "unwrap_map" )
+		|| !dst.acquire( dst_obj, 'B', true, "dst" ) )
+	{
+		return NULL;
+	}
+	if( !check_size( unwrap_map.mat, unwrap_map.mat.size(), 2, "unwrap_map" )
+		|| !check_size( dst.mat, unwrap_map.mat.size(), src.mat.channels(), "dst" ) )
+	{
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	cv::remap( src.mat, dst.mat, unwrap_map.mat, cv::Mat(), cv::INTER_LANCZOS4 );
+	Py_END_ALLOW_THREADS
+
+	Py_RETURN_NONE;
+}
+
+
+static PyMethodDef lens_undistort_methods[] = {
+	{ "extract_lines", py_extract_lines, METH_VARARGS,
+		"extract_lines(frame) -> list of lines\n\nframe is a (h, w, 3) uint8 image. every line is a list of (x, y) points." },
+	{ "fitUndistorsionModel", py_fitUndistorsionModel, METH_VARARGS,
+		"fitUndistorsionModel(lines, (width, height)) -> (cx, cy, k1, k2)\n\n"
+		"every line is a sequence of (x, y) int points, tuples, lists or an (N, 2) int array." },
+	{ "unwrap_size", py_unwrap_size, METH_VARARGS,
+		"unwrap_size(factors, (width, height), unwrap_factor) -> (width, height) of the map prepare_unwrap produces" },
+	{ "prepare_unwrap", py_prepare_unwrap, METH_VARARGS,
+		"prepare_unwrap(factors, (width, height), unwrap_factor, unwrap_map, unwrap_mask)\n\n"
+		"fills the preallocated (h, w, 2) float32 unwrap_map and (h, w) uint8 unwrap_mask." },
+	{ "update_unwrap", py_update_unwrap, METH_VARARGS,
+		"update_unwrap(previous_factors, factors, (width, height), unwrap_factor, unwrap_map, unwrap_mask)\n\n"
+		"regenerates the unwrap_map and unwrap_mask of previous_factors in place for the slightly different factors,\n"
+		"much faster than prepare_unwrap. fails if the unwrapped size changed." },
+	{ "undistort_points", py_undistort_points, METH_VARARGS,
+		"undistort_points(factors, points, out)\n\npoints and out are (N, 2) float64 arrays, out may be points." },
+	{ "distort_points", py_distort_points, METH_VARARGS,
+		"distort_points(factors, points, out)\n\npoints and out are (N, 2) float64 arrays, out may be points." },
+	{ "remap", py_remap, METH_VARARGS,
+		"remap(src, unwrap_map, dst)\n\nlanczos remap of the uint8 src into the preallocated dst, which has the size of unwrap_map." },
+	{ NULL, NULL, 0, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+
+static struct PyModuleDef lens_undistort_module = {
+	PyModuleDef_HEAD_INIT,
+	"lens_undistort",
+	"lens distortion calibration and unwrapping",
+	-1,
+	lens_undistort_methods
+};
+
+PyMODINIT_FUNC PyInit_lens_undistort( void )
+{
+	return PyModule_Create( &lens_undistort_module );
+}
+
+#else
+
+PyMODINIT_FUNC initlens_undistort( void )
+{
+	Py_InitModule3( "lens_undistort", lens_undistort_methods, "lens distortion calibration and unwrapping" );
+}
+
+#endif
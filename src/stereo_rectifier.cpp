@@ -0,0 +1,89 @@
+#include "stereo_rectifier.h"
+
+#include "glog/logging.h"
+
+#include <algorithm>
+
+
+// rows of a band, small enough for many bands per thread, big enough to walk the map sequentially
+static const int BAND_ROWS = 16;
+
+
+StereoRectifier::StereoRectifier( const cv::Mat &left_map, const cv::Mat &right_map, StereoLayout layout )
+	: left(left_map), right(right_map), layout(layout)
+{
+	CHECK( left_map.size()==right_map.size() ) << "the maps of the two eyes should have the same size";
+}
+
+cv::Size StereoRectifier::output_size() const
+{
+	cv::Size eye = eye_size();
+	if( layout==StereoLayout::SIDE_BY_SIDE )
+	{
+		return cv::Size( eye.width * 2, eye.height );
+	}
+	return cv::Size( eye.width, eye.height * 2 );
+}
+
+cv::Mat StereoRectifier::eye_view( cv::Mat &output, int eye ) const
+{
+	cv::Size size = eye_size();
+	if( layout==StereoLayout::SIDE_BY_SIDE )
+	{
+		return output( cv::Rect( eye * size.width, 0, size.width, size.height ) );
+	}
+	// every second row, starting at the eye's
+	return cv::Mat( size.height, size.width, output.type(), output.ptr( eye ), output.step * 2 );
+}
+
+
+// bands of the left eye come first, then the bands of the right eye
+class StereoRectifyBody : public cv::ParallelLoopBody
+{
+public:
+	StereoRectifyBody( const LanczosRemapper *remappers[2], const cv::Mat *frames[2], cv::Mat *views[2], int bands_per_eye )
+		: bands_per_eye(bands_per_eye)
+	{
+		for( int eye=0; eye<2; eye++ )
+		{
+			this->remappers[eye] = remappers[eye];
+			this->frames[eye] = frames[eye];
+			this->views[eye] = views[eye];
+		}
+	}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int band=range.start; band<range.end; band++ )
+		{
+			int eye = band / bands_per_eye;
+			int first_row = ( band % bands_per_eye ) * BAND_ROWS;
+			cv::Range rows( first_row, std::min( first_row + BAND_ROWS, views[eye]->rows ) );
+			remappers[eye]->execute_rows( *frames[eye], *views[eye], rows );
+		}
+	}
+
+private:
+	const LanczosRemapper *remappers[2];
+	const cv::Mat *frames[2];
+	cv::Mat *views[2];
+	int bands_per_eye;
+};
+
+
+void StereoRectifier::rectify( const cv::Mat &left_frame, const cv::Mat &right_frame, cv::Mat &output ) const
+{
+	CHECK( LanczosRemapper::supports( left_frame ) && LanczosRemapper::supports( right_frame ) ) << "only CV_8UC1 and CV_8UC3 frames are supported";
+
+	output.create( output_size(), CV_8UC1 );
+
+	cv::Mat left_view = eye_view( output, 0 );
+	cv::Mat right_view = eye_view( output, 1 );
+
+	const LanczosRemapper *remappers[2] = { &left, &right };
+	const cv::Mat *frames[2] = { &left_frame, &right_frame };
+	cv::Mat *views[2] = { &left_view, &right_view };
+	int bands_per_eye = ( eye_size().height + BAND_ROWS - 1 ) / BAND_ROWS;
+
+	cv::parallel_for_( cv::Range( 0, 2 * bands_per_eye ), StereoRectifyBody( remappers, frames, views, bands_per_eye ) );
+}
@@ -0,0 +1,108 @@
+#include "streaming_calibration.h"
+
+#include "glog/logging.h"
+
+#include <algorithm>
+
+
+StreamingCalibrator::StreamingCalibrator( cv::Size frame_size, const StreamingCalibrationOptions &options, const ProgressContext *context )
+	: options(options), context(context), seen(0), batches(0), random(options.seed)
+{
+	CHECK_GT( options.batch_size, 0u );
+
+	// the same initial guess as fitUndistorsionModel
+	undistorsion_factors[0] = ((double)frame_size.width) / 2.0;
+	undistorsion_factors[1] = ((double)frame_size.height) / 2.0;
+	undistorsion_factors[2] = 0.0;
+	undistorsion_factors[3] = 0.0;
+
+	if( context!=nullptr )
+	{
+		batch_context.cancellation = context->cancellation;
+	}
+
+	batch.reserve( options.batch_size );
+	reservoir.reserve( options.reservoir_size );
+}
+
+bool StreamingCalibrator::add( const Line &line )
+{
+	seen++;
+
+	// algorithm R: the n-th line replaces a random one with probability reservoir_size / n
+	if( reservoir.size()<options.reservoir_size )
+	{
+		reservoir.push_back( line );
+	}
+	else if( options.reservoir_size>0 )
+	{
+		std::uniform_int_distribution<size_t> pick( 0, seen-1 );
+		size_t idx = pick( random );
+		if( idx<options.reservoir_size )
+		{
+			reservoir[idx] = line;
+		}
+	}
+
+	batch.push_back( line );
+	if( batch.size()>=options.batch_size )
+	{
+		return fit_batch();
+	}
+	return true;
+}
+
+bool StreamingCalibrator::add( const Lines &lines )
+{
+	for( const Line &line : lines )
+	{
+		if( !add( line ) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool StreamingCalibrator::fit_batch()
+{
+	double previous[MODEL_SIZE];
+	std::copy( undistorsion_factors, undistorsion_factors + MODEL_SIZE, previous );
+
+	StreamingBatchReport report;
+	bool completed = refineUndistorsionModel( batch, undistorsion_factors, &batch_context, options.batch_iterations, &report.cost );
+	batch.clear();
+	if( !completed )
+	{
+		return false;
+	}
+
+	report.batch = ++batches;
+	report.lines_seen = seen;
+	for( int i=0; i<MODEL_SIZE; i++ )
+	{
+		report.undistorsion_factors[i] = undistorsion_factors[i];
+		report.change[i] = undistorsion_factors[i] - previous[i];
+	}
+	if( options.batch_callback )
+	{
+		options.batch_callback( report );
+	}
+	return true;
+}
+
+bool StreamingCalibrator::finish( double result[MODEL_SIZE] )
+{
+	bool completed = true;
+	if( !batch.empty() )
+	{
+		completed = fit_batch();
+	}
+	if( completed && !reservoir.empty() )
+	{
+		completed = refineUndistorsionModel( reservoir, undistorsion_factors, context );
+	}
+
+	std::copy( undistorsion_factors, undistorsion_factors + MODEL_SIZE, result );
+	return completed;
+}
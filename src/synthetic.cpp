@@ -0,0 +1,88 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+class RenderStripesBody : public cv::ParallelLoopBody
+{
+public:
+	RenderStripesBody( const StripeTarget &target, cv::Mat &frame )
+		: target(target), frame(frame) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		const double *factors = target.undistorsion_factors;
+		cv::Point2d normal( cos( target.angle ), sin( target.angle ) );
+		cv::Point2d center( factors[0], factors[1] );
+		// squared distance of the farthest corner
+		double far_x = std::max( center.x, target.frame_size.width - center.x );
+		double far_y = std::max( center.y, target.frame_size.height - center.y );
+		double corner_radius2 = std::max( far_x*far_x + far_y*far_y, 1.0 );
+
+		for( int y=range.start; y<range.end; y++ )
+		{
+			cv::Vec3b *row = frame.ptr<cv::Vec3b>(y);
+			for( int x=0; x<frame.cols; x++ )
+			{
+				cv::Point2d point( x, y );
+				cv::Point2d undistorted = undistort( factors, point );
+
+				// how many undistorted pixels one frame pixel covers across the stripes
+				cv::Point2d along_x = undistort( factors, point + cv::Point2d( 1.0, 0.0 ) ) - undistorted;
+				cv::Point2d along_y = undistort( factors, point + cv::Point2d( 0.0, 1.0 ) ) - undistorted;
+				double footprint = std::max( std::abs( along_x.dot( normal ) ) + std::abs( along_y.dot( normal ) ), 1e-6 );
+
+				// signed distance to the closest stripe edge in undistorted pixels, positive in the bright stripes
+				double s = undistorted.dot( normal ) / target.period + target.phase;
+				double t = s - std::floor( s );
+				double distance = t<0.5
+					? std::min( t, 0.5 - t ) * target.period
+					: -std::min( t - 0.5, 1.0 - t ) * target.period;
+				double coverage = std::min( 1.0, std::max( 0.0, 0.5 + distance / footprint ) );
+
+				double dx = x - center.x;
+				double dy = y - center.y;
+				double brightness = 1.0 - target.vignetting * ( dx*dx + dy*dy ) / corner_radius2;
+
+				double gray = ( 128.0 + target.contrast * ( coverage - 0.5 ) ) * brightness;
+				uchar value = cv::saturate_cast<uchar>( gray );
+				row[x] = cv::Vec3b( value, value, value );
+			}
+		}
+	}
+
+private:
+	const StripeTarget &target;
+	cv::Mat &frame;
+};
+
+
+void render_stripes( const StripeTarget &target, cv::Mat &frame, cv::RNG &rng )
+{
+	frame.create( target.frame_size, CV_8UC3 );
+	cv::parallel_for_( cv::Range( 0, frame.rows ), RenderStripesBody( target, frame ) );
+
+	if( target.blur>0.0 )
+	{
+		cv::GaussianBlur( frame, frame, cv::Size(), target.blur );
+	}
+
+	if( target.noise>0.0 )
+	{
+		cv::Mat noise( frame.size(), CV_16SC3 );
+		rng.fill( noise, cv::RNG::NORMAL, 0.0, target.noise );
+		cv::Mat noisy;
+		frame.convertTo( noisy, CV_16SC3 );
+		noisy += noise;
+		noisy.convertTo( frame, CV_8UC3 );
+	}
+}
+
+StripeTarget stripe_sequence_frame( const StripeTarget &base, int index, int count, cv::RNG &rng )
+{
+	StripeTarget target = base;
+	target.angle = base.angle + CV_PI * index / std::max( count, 1 );
+	target.phase = rng.uniform( 0.0, 1.0 );
+	return target;
+}
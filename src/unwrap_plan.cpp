@@ -0,0 +1,158 @@
+#include "unwrap_plan.h"
+
+#include "glog/logging.h"
+
+#include <string.h>
+
+
+UnwrapPlan::UnwrapPlan(
+	const double undistorsion_factors[MODEL_SIZE],
+	cv::Size frame_size,
+	double unwrap_factor,
+	const UnwrapPlanOptions &options
+)
+	: frame_size(frame_size), unwrap_factor(unwrap_factor), options(options), interpolation(options.interpolation)
+{
+	// the context may not outlive the construction
+	this->options.context = nullptr;
+
+	unwrapped_rectangle = unwrap_rectangle( undistorsion_factors, frame_size, unwrap_factor );
+
+	if( options.rectification_map.empty() )
+	{
+		unwrap_grid = ::unwrap_grid( undistorsion_factors, frame_size, unwrap_factor, options.roi, options.output_size );
+		completed = prepare_unwrap( undistorsion_factors, frame_size, unwrap_grid, unwrap_map, unwrap_mask, options.context, options.inverse );
+	}
+	else
+	{
+		completed = concatenate_rectification_map_and_unwrap( undistorsion_factors, options.rectification_map, frame_size, unwrap_factor, unwrap_map, unwrap_mask, options.context, options.inverse );
+	}
+
+	convert_map( options.format );
+	if( completed )
+	{
+		spans = ::valid_spans( unwrap_map, frame_size );
+	}
+}
+
+UnwrapPlan::UnwrapPlan(
+	const cv::Mat &unwrap_map,
+	MapFormat format,
+	int interpolation
+)
+	: unwrap_factor(0.0), unwrap_map(unwrap_map), interpolation(interpolation), completed(true)
+{
+	CHECK_EQ( unwrap_map.type(), CV_32FC2 ) << "unwrap map should be CV_32FC2";
+
+	options.format = format;
+	convert_map( format );
+}
+
+bool UnwrapPlan::update( const double undistorsion_factors[MODEL_SIZE], const ProgressContext *context )
+{
+	CHECK( frame_size.area()>0 && options.rectification_map.empty() ) << "only plans of the lens model can be updated";
+	CHECK( completed ) << "the plan to update is incomplete";
+
+	UnwrapGrid grid = ::unwrap_grid( undistorsion_factors, frame_size, unwrap_factor, options.roi, options.output_size );
+	completed = update_unwrap( unwrap_grid, undistorsion_factors, frame_size, grid, unwrap_map, unwrap_mask, context, options.inverse );
+
+	unwrapped_rectangle = unwrap_rectangle( undistorsion_factors, frame_size, unwrap_factor );
+	unwrap_grid = grid;
+
+	convert_map( options.format );
+	spans = completed ? ::valid_spans( unwrap_map, frame_size ) : ValidSpans();
+	return completed;
+}
+
+void UnwrapPlan::convert_map( MapFormat format )
+{
+	if( format==MapFormat::FIXED_POINT )
+	{
+		cv::convertMaps( unwrap_map, cv::Mat(), remap_map1, remap_map2, CV_16SC2 );
+	}
+	else if( format==MapFormat::LANCZOS_TABLE && interpolation==cv::INTER_LANCZOS4 )
+	{
+		lanczos.reset( new LanczosRemapper( unwrap_map ) );
+		remap_map1 = unwrap_map;
+	}
+	else
+	{
+		remap_map1 = unwrap_map;
+	}
+}
+
+void UnwrapPlan::set_valid_spans( const ValidSpans &spans )
+{
+	CHECK_EQ( spans.rows(), unwrap_map.rows ) << "the spans are of another map";
+	this->spans = spans;
+}
+
+
+// zeroes the gaps between the spans of rows, and remaps the spans
+class SpanRemapBody : public cv::ParallelLoopBody
+{
+public:
+	SpanRemapBody( const ValidSpans &spans, const LanczosRemapper *lanczos, const cv::Mat &map1, const cv::Mat &map2, int interpolation, const cv::Mat &src, cv::Mat &dst )
+		: spans(spans), lanczos(lanczos), map1(map1), map2(map2), interpolation(interpolation), src(src), dst(dst) {}
+
+	void operator()( const cv::Range &range ) const
+	{
+		for( int y=range.start; y<range.end; y++ )
+		{
+			uchar *row = dst.ptr<uchar>(y);
+			int end = 0;
+			for( int i=spans.row_offsets[y]; i<spans.row_offsets[y+1]; i++ )
+			{
+				cv::Range cols( spans.spans[i][0], spans.spans[i][0] + spans.spans[i][1] );
+				memset( row + end * dst.elemSize(), 0, ( cols.start - end ) * dst.elemSize() );
+				remap( y, cols );
+				end = cols.end;
+			}
+			memset( row + end * dst.elemSize(), 0, ( dst.cols - end ) * dst.elemSize() );
+		}
+	}
+
+private:
+	void remap( int y, cv::Range cols ) const
+	{
+		if( lanczos )
+		{
+			lanczos->execute_block( src, dst, cv::Range( y, y + 1 ), cols );
+			return;
+		}
+		// dst fits the span already, so cv::remap writes into it
+		cv::Mat out = dst.row(y).colRange( cols );
+		cv::remap( src, out, map1.row(y).colRange( cols ), map2.empty() ? map2 : map2.row(y).colRange( cols ), interpolation );
+	}
+
+	const ValidSpans &spans;
+	const LanczosRemapper *lanczos;
+	const cv::Mat &map1;
+	const cv::Mat &map2;
+	int interpolation;
+	const cv::Mat &src;
+	cv::Mat &dst;
+};
+
+
+void UnwrapPlan::execute( const cv::Mat &src, cv::Mat &dst ) const
+{
+	const LanczosRemapper *remapper = lanczos && LanczosRemapper::supports( src ) ? lanczos.get() : nullptr;
+
+	if( !spans.empty() && src.size()==spans.frame_size )
+	{
+		CHECK( src.data!=dst.data ) << "can't remap in place";
+		dst.create( output_size(), src.type() );
+		cv::parallel_for_( cv::Range( 0, dst.rows ), SpanRemapBody( spans, remapper, remap_map1, remap_map2, interpolation, src, dst ) );
+		return;
+	}
+
+	if( remapper )
+	{
+		remapper->execute( src, dst );
+		return;
+	}
+
+	// cv::remap only allocates dst if it has to
+	cv::remap( src, dst, remap_map1, remap_map2, interpolation );
+}
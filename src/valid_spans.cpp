@@ -0,0 +1,59 @@
+#include "valid_spans.h"
+
+#include "glog/logging.h"
+
+
+// the Lanczos4 window of x covers floor(x)-3 .. floor(x)+4
+static inline bool touches_frame( float x, int size )
+{
+	return x>=-4.0f && x<size+3.0f;
+}
+
+
+ValidSpans valid_spans( const cv::Mat &map, cv::Size frame_size )
+{
+	CHECK_EQ( map.type(), CV_32FC2 ) << "map should be CV_32FC2";
+
+	ValidSpans index;
+	index.frame_size = frame_size;
+	index.row_offsets.reserve( map.rows + 1 );
+
+	for( int y=0; y<map.rows; y++ )
+	{
+		index.row_offsets.push_back( index.spans.size() );
+
+		const cv::Vec2f *row = map.ptr<cv::Vec2f>(y);
+		int start = -1;
+		for( int x=0; x<=map.cols; x++ )
+		{
+			// NaN compares false, so it is invalid
+			bool valid = x<map.cols && touches_frame( row[x][0], frame_size.width ) && touches_frame( row[x][1], frame_size.height );
+			if( valid && start<0 )
+			{
+				start = x;
+			}
+			else if( !valid && start>=0 )
+			{
+				index.spans.push_back( cv::Vec2i( start, x - start ) );
+				start = -1;
+			}
+		}
+	}
+	index.row_offsets.push_back( index.spans.size() );
+
+	return index;
+}
+
+double ValidSpans::coverage( int cols ) const
+{
+	if( empty() || cols<=0 )
+	{
+		return 0.0;
+	}
+	double pixels = 0.0;
+	for( const cv::Vec2i &span : spans )
+	{
+		pixels += span[1];
+	}
+	return pixels / ( (double)cols * rows() );
+}